@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bloom.h"
+
+#define BLOCK_WORDS 8          /* 8 x 64 bits = one cache line */
+#define BITS_PER_KEY 12        /* about 0.5% false positives at k = 8 */
+
+typedef struct { _Alignas(64) atomic_uint_fast64_t w[BLOCK_WORDS]; } bloom_block_t;
+
+struct bloom {
+    bloom_block_t *blocks;
+    uint64_t nblocks;
+};
+
+struct bloom_window {
+    bloom_t *gen[2];
+    int64_t started_ms[2];
+    int cur;
+    int64_t window_ms;
+    pthread_rwlock_t lock;     /* write-held only while rotating */
+};
+
+/* 64-bit FNV-1a with a final avalanche so low and high halves are both
+ * usable. */
+uint64_t bloom_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 1099511628211ull; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+bloom_t *bloom_new(size_t expected_keys) {
+    bloom_t *b = malloc(sizeof(*b));
+    if (!b) return NULL;
+    b->nblocks = (expected_keys * BITS_PER_KEY + 511) / 512;
+    if (b->nblocks == 0) b->nblocks = 1;
+    b->blocks = aligned_alloc(64, b->nblocks * sizeof(bloom_block_t));
+    if (!b->blocks) { free(b); return NULL; }
+    bloom_clear(b);
+    return b;
+}
+
+void bloom_clear(bloom_t *b) {
+    memset(b->blocks, 0, b->nblocks * sizeof(bloom_block_t));
+}
+
+/* The high half picks the block; BLOOM_K steps of an LCG seeded with the
+ * whole hash give the bit positions (top 9 bits of each step). */
+static void key_mask(uint64_t hash, uint64_t nblocks, uint64_t *block, uint64_t mask[BLOCK_WORDS]) {
+    *block = ((hash >> 32) * nblocks) >> 32;
+    uint64_t x = hash;
+    memset(mask, 0, BLOCK_WORDS * sizeof(*mask));
+    for (int i = 0; i < BLOOM_K; i++) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        unsigned bit = (unsigned)(x >> 55);
+        mask[bit >> 6] |= 1ull << (bit & 63);
+    }
+}
+
+void bloom_add(bloom_t *b, uint64_t hash) {
+    uint64_t block, mask[BLOCK_WORDS];
+    key_mask(hash, b->nblocks, &block, mask);
+    for (int i = 0; i < BLOCK_WORDS; i++)
+        if (mask[i]) atomic_fetch_or_explicit(&b->blocks[block].w[i], mask[i], memory_order_relaxed);
+}
+
+int bloom_maybe(const bloom_t *b, uint64_t hash) {
+    uint64_t block, mask[BLOCK_WORDS], miss = 0;
+    key_mask(hash, b->nblocks, &block, mask);
+    for (int i = 0; i < BLOCK_WORDS; i++)
+        miss |= mask[i] & ~atomic_load_explicit(&b->blocks[block].w[i], memory_order_relaxed);
+    return miss == 0;
+}
+
+bloom_window_t *bloom_window_new(size_t keys_per_window, int64_t window_ms) {
+    bloom_window_t *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->gen[0] = bloom_new(keys_per_window);
+    w->gen[1] = bloom_new(keys_per_window);
+    if (!w->gen[0] || !w->gen[1]) return NULL;
+    w->window_ms = window_ms;
+    w->started_ms[0] = w->started_ms[1] = INT64_MIN;
+    pthread_rwlock_init(&w->lock, NULL);
+    return w;
+}
+
+/* Start a new window if the current one is full of time, clearing the
+ * oldest filter. */
+static void rotate(bloom_window_t *w, int64_t now_ms) {
+    pthread_rwlock_wrlock(&w->lock);
+    if (w->started_ms[w->cur] == INT64_MIN) {
+        w->started_ms[w->cur] = now_ms;
+    } else if (now_ms - w->started_ms[w->cur] >= w->window_ms) {
+        int old = !w->cur;
+        bloom_clear(w->gen[old]);
+        w->started_ms[old] = now_ms;
+        w->cur = old;
+    }
+    pthread_rwlock_unlock(&w->lock);
+}
+
+void bloom_window_add(bloom_window_t *w, uint64_t hash, int64_t now_ms) {
+    pthread_rwlock_rdlock(&w->lock);
+    int64_t started = w->started_ms[w->cur];
+    int stale = started == INT64_MIN || now_ms - started >= w->window_ms;
+    pthread_rwlock_unlock(&w->lock);
+    if (stale) rotate(w, now_ms);
+
+    pthread_rwlock_rdlock(&w->lock);
+    bloom_add(w->gen[w->cur], hash);
+    pthread_rwlock_unlock(&w->lock);
+}
+
+int bloom_window_maybe(bloom_window_t *w, uint64_t hash, int64_t since_ms) {
+    pthread_rwlock_rdlock(&w->lock);
+    int prev = !w->cur;
+    /* The previous filter covers from its start unless it was never used. */
+    int64_t covered = w->started_ms[prev] != INT64_MIN ? w->started_ms[prev] : w->started_ms[w->cur];
+    int maybe = since_ms < covered
+             || bloom_maybe(w->gen[w->cur], hash)
+             || bloom_maybe(w->gen[prev], hash);
+    pthread_rwlock_unlock(&w->lock);
+    return maybe;
+}
@@ -0,0 +1,29 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Blocked Bloom filter: each key sets BLOOM_K bits inside one 64-byte block,
+ * so a lookup touches a single cache line. Adds and lookups are lock-free. */
+#define BLOOM_K 8
+
+typedef struct bloom bloom_t;
+
+bloom_t *bloom_new(size_t expected_keys);
+void bloom_add(bloom_t *b, uint64_t hash);
+int bloom_maybe(const bloom_t *b, uint64_t hash);
+void bloom_clear(bloom_t *b);
+
+/* Two filters covering consecutive time windows. Keys added in the current
+ * window are remembered for at least one full window; bloom_window_maybe
+ * answers "maybe" for anything older than the filters cover. */
+typedef struct bloom_window bloom_window_t;
+
+bloom_window_t *bloom_window_new(size_t keys_per_window, int64_t window_ms);
+void bloom_window_add(bloom_window_t *w, uint64_t hash, int64_t now_ms);
+int bloom_window_maybe(bloom_window_t *w, uint64_t hash, int64_t since_ms);
+
+uint64_t bloom_hash(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "breaker.h"
+
+#define BREAKER_WINDOW 32        /* outcomes remembered for the error rate */
+#define BREAKER_MIN_SAMPLES 8
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static breaker_state_t state = BREAKER_CLOSED;
+static uint32_t outcomes = 0;    /* bit i set = call i failed */
+static int samples = 0;
+static double ewma_latency = 0;
+static int64_t opened_at = 0;
+static int probing = 0;
+
+static int cfg_error_pct = 50;
+static int cfg_latency_ms = 1000;
+static int cfg_cooldown_ms = 5000;
+
+static int env_int(const char *name, int def) {
+    const char *v = getenv(name);
+    return v && atoi(v) > 0 ? atoi(v) : def;
+}
+
+int64_t breaker_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void breaker_init(void) {
+    cfg_error_pct = env_int("CHAT_BREAKER_ERROR_PCT", 50);
+    cfg_latency_ms = env_int("CHAT_BREAKER_LATENCY_MS", 1000);
+    cfg_cooldown_ms = env_int("CHAT_BREAKER_COOLDOWN_MS", 5000);
+}
+
+static void trip(const char *why) {
+    if (state != BREAKER_OPEN)
+        fprintf(stderr, "[BREAKER] Open (%s): serving from cache, spooling writes\n", why);
+    state = BREAKER_OPEN;
+    opened_at = breaker_now_ms();
+    probing = 0;
+}
+
+int breaker_allow(void) {
+    int allow;
+    pthread_mutex_lock(&lock);
+    if (state == BREAKER_OPEN && breaker_now_ms() - opened_at >= cfg_cooldown_ms) {
+        state = BREAKER_HALF_OPEN;
+        probing = 0;
+    }
+    if (state == BREAKER_CLOSED) {
+        allow = 1;
+    } else if (state == BREAKER_HALF_OPEN && !probing) {
+        probing = 1;             /* exactly one probe at a time */
+        allow = 1;
+    } else {
+        allow = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return allow;
+}
+
+void breaker_record(int ok, int64_t latency_ms) {
+    pthread_mutex_lock(&lock);
+    if (state == BREAKER_HALF_OPEN) {
+        if (ok && latency_ms < cfg_latency_ms) {
+            state = BREAKER_CLOSED;
+            outcomes = 0;
+            samples = 0;
+            ewma_latency = (double)latency_ms;
+            probing = 0;
+            fprintf(stderr, "[BREAKER] Closed: database healthy again\n");
+        } else {
+            trip("probe failed");
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (state == BREAKER_OPEN) {     /* a call that started before we tripped */
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    outcomes = (outcomes << 1) | (ok ? 0u : 1u);
+    if (samples < BREAKER_WINDOW) samples++;
+    ewma_latency = samples == 1 ? (double)latency_ms : 0.8 * ewma_latency + 0.2 * (double)latency_ms;
+
+    if (samples >= BREAKER_MIN_SAMPLES) {
+        uint32_t mask = samples >= 32 ? 0xffffffffu : ((1u << samples) - 1);
+        int failed = __builtin_popcount(outcomes & mask);
+        if (failed * 100 >= cfg_error_pct * samples) trip("error rate");
+        else if (ewma_latency > cfg_latency_ms) trip("latency");
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+breaker_state_t breaker_state(void) {
+    pthread_mutex_lock(&lock);
+    breaker_state_t s = state;
+    pthread_mutex_unlock(&lock);
+    return s;
+}
@@ -0,0 +1,26 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdint.h>
+
+/* Circuit breaker around MongoDB calls.
+ *
+ *   CHAT_BREAKER_ERROR_PCT    trip when this share of recent calls fail (50)
+ *   CHAT_BREAKER_LATENCY_MS   trip when smoothed latency exceeds this (1000)
+ *   CHAT_BREAKER_COOLDOWN_MS  time open before a probe is let through (5000)
+ *
+ * While open the server runs degraded: reads come from the cache and writes
+ * are spooled locally (see spool.h). */
+typedef enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN } breaker_state_t;
+
+void breaker_init(void);
+
+/* 1 if the caller may go to the database. Every allowed call must be
+ * followed by breaker_record(). */
+int breaker_allow(void);
+void breaker_record(int ok, int64_t latency_ms);
+breaker_state_t breaker_state(void);
+
+int64_t breaker_now_ms(void);
+
+#endif
@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "mem.h"
+
+/* Columnar store. Message i (a logical, ever-increasing index) lives in slot
+ * i % cap of each column; its text is len[i] bytes at logical offset off[i]
+ * of an append-only arena that wraps. A message is evicted when its slot is
+ * reused or the arena writes over its text, whichever comes first, so
+ * [first, next) is always the live range. */
+static int64_t *col_ts;
+static uint64_t *col_off;
+static uint32_t *col_len;
+static uint32_t *col_room;         /* interned ids */
+static uint32_t *col_author;
+static unsigned char (*col_id)[CHAT_ID_LEN];
+static size_t cap = 0;
+
+static char *arena;
+static uint64_t arena_size;
+static uint64_t arena_head = 0;       /* logical write offset */
+
+/* Message ids by commit time, so most "have we seen this id" checks
+ * (nearly always "no" for remote commits) skip the scan. */
+#define CACHE_ID_WINDOW_MS 60000
+static bloom_window_t *ids;
+
+static size_t first = 0, next = 0;
+static int complete = 0;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Drop the oldest live message. Caller holds the write lock. */
+static size_t evict_oldest(void) {
+    size_t len = col_len[first % cap];
+    first++;
+    mem_charge(MEM_CACHE, -(long)len);
+    return len;
+}
+
+/* Budget reclaimer: evict the oldest messages until want bytes of text are
+ * gone and hand the arena pages they occupied back to the kernel. */
+static size_t cache_reclaim(size_t want) {
+    size_t freed = 0;
+    pthread_rwlock_wrlock(&lock);
+    if (cap && first < next) {
+        uint64_t lo = col_off[first % cap];
+        while (freed < want && first < next) freed += evict_oldest();
+        uint64_t hi = first < next ? col_off[first % cap] : arena_head;
+        complete = 0;
+        /* [lo, hi) holds only evicted text; it may wrap once. */
+        if (hi - lo >= arena_size) {
+            mem_release(arena, arena_size);
+        } else {
+            uint64_t a = lo % arena_size, b = hi % arena_size;
+            if (a <= b) {
+                mem_release(arena + a, b - a);
+            } else {
+                mem_release(arena + a, arena_size - a);
+                mem_release(arena, b);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+    return freed;
+}
+
+static void cache_on_commit(const chat_msg_t *msg, void *ctx) {
+    (void)ctx;
+    cache_append(msg);
+}
+
+int cache_init(size_t capacity, size_t arena_bytes) {
+    if (capacity == 0 || arena_bytes < CACHE_TEXT_MAX) return -1;
+    col_ts = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_ts));
+    col_off = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_off));
+    col_len = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_len));
+    col_room = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_room));
+    col_author = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_author));
+    col_id = mem_alloc_large(MEM_CACHE, capacity * sizeof(*col_id));
+    arena = mem_reserve_large(MEM_CACHE, arena_bytes);
+    ids = bloom_window_new(capacity, CACHE_ID_WINDOW_MS);
+    if (!ids || !col_ts || !col_off || !col_len || !col_room || !col_author || !col_id || !arena) return -1;
+    cap = capacity;
+    arena_size = arena_bytes;
+    printf("[CACHE] %zu messages, %zu byte text arena\n", capacity, arena_bytes);
+    mem_set_reclaim(MEM_CACHE, cache_reclaim);
+    return commit_subscribe(cache_on_commit, NULL);
+}
+
+void cache_append(const chat_msg_t *msg) {
+    if (!cap) return;
+    uint32_t len = msg->len < CACHE_TEXT_MAX ? (uint32_t)msg->len : CACHE_TEXT_MAX;
+    int charged = mem_try_charge(MEM_CACHE, len) == 0;
+    bloom_window_add(ids, bloom_hash(msg->id, CHAT_ID_LEN), msg->ts_ms);
+
+    pthread_rwlock_wrlock(&lock);
+    /* Keep each string contiguous: skip the arena tail if it won't fit. */
+    uint64_t off = arena_head;
+    if (off % arena_size + len > arena_size) off += arena_size - off % arena_size;
+    arena_head = off + len;
+
+    uint64_t overwritten = arena_head > arena_size ? arena_head - arena_size : 0;
+    if (next - first == cap) evict_oldest();
+    while (first < next && col_off[first % cap] < overwritten) evict_oldest();
+    if (!charged) {
+        /* Over budget: make room out of our own oldest messages instead. */
+        size_t freed = 0;
+        while (freed < len && first < next) freed += evict_oldest();
+        mem_charge(MEM_CACHE, len);
+    }
+    if (first > 0) complete = 0;
+
+    size_t slot = next % cap;
+    memcpy(arena + off % arena_size, msg->text, len);
+    col_ts[slot] = msg->ts_ms;
+    col_off[slot] = off;
+    col_len[slot] = len;
+    col_room[slot] = msg->room;
+    col_author[slot] = msg->author;
+    memcpy(col_id[slot], msg->id, CHAT_ID_LEN);
+    next++;
+    pthread_rwlock_unlock(&lock);
+}
+
+void cache_set_complete(int value) {
+    pthread_rwlock_wrlock(&lock);
+    complete = value && first == 0;
+    pthread_rwlock_unlock(&lock);
+}
+
+int cache_is_complete(void) {
+    pthread_rwlock_rdlock(&lock);
+    int c = cap != 0 && complete;
+    pthread_rwlock_unlock(&lock);
+    return c;
+}
+
+/* First live index with ts >= since_ms. Commit order is timestamp order up
+ * to clock skew between servers, so a lower-bound search is close enough. */
+static size_t seek_time(int64_t since_ms) {
+    size_t lo = first, hi = next;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (col_ts[mid % cap] < since_ms) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int cache_contains_recent(const unsigned char id[CHAT_ID_LEN], int64_t since_ms) {
+    int found = 0;
+    if (ids && !bloom_window_maybe(ids, bloom_hash(id, CHAT_ID_LEN), since_ms)) return 0;
+    pthread_rwlock_rdlock(&lock);
+    if (cap) {
+        for (size_t i = seek_time(since_ms); i < next; i++) {
+            if (memcmp(col_id[i % cap], id, CHAT_ID_LEN) == 0) { found = 1; break; }
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+    return found;
+}
+
+uint64_t cache_seq(void) {
+    pthread_rwlock_rdlock(&lock);
+    uint64_t seq = next;
+    pthread_rwlock_unlock(&lock);
+    return seq;
+}
+
+/* Rendered a chunk at a time so a long render never holds writers off for
+ * more than CACHE_RENDER_CHUNK lines. Messages past upto are never shown;
+ * ones evicted between chunks are skipped. */
+#define CACHE_RENDER_CHUNK 64
+
+void cache_render_since(char *buffer, size_t buffer_size, int64_t since_ms, uint64_t upto) {
+    size_t used = 0;
+    buffer[0] = '\0';
+    pthread_rwlock_rdlock(&lock);
+    size_t i = cap ? seek_time(since_ms) : 0;
+    pthread_rwlock_unlock(&lock);
+    while (cap && i < upto && used + 1 < buffer_size) {
+        pthread_rwlock_rdlock(&lock);
+        if (i < first) i = first;
+        size_t end = i + CACHE_RENDER_CHUNK;
+        if (end > next) end = next;
+        if (end > upto) end = upto;
+        for (; i < end && used + 1 < buffer_size; i++) {
+            size_t slot = i % cap;
+            used += chat_format_line(buffer + used, buffer_size - used, col_ts[slot], col_author[slot],
+                                     arena + col_off[slot] % arena_size, col_len[slot]);
+        }
+        int done = i >= next;
+        pthread_rwlock_unlock(&lock);
+        if (done) break;
+    }
+}
+
+static void fill_msg(size_t i, chat_msg_t *msg) {
+    size_t slot = i % cap;
+    msg->text = arena + col_off[slot] % arena_size;
+    msg->len = col_len[slot];
+    msg->ts_ms = col_ts[slot];
+    memcpy(msg->id, col_id[slot], CHAT_ID_LEN);
+    msg->remote = 0;
+    msg->room = col_room[slot];
+    msg->author = col_author[slot];
+}
+
+size_t cache_visit(int64_t since_ms, uint32_t room, size_t limit, int tail, cache_visit_fn fn, void *ctx) {
+    size_t visited = 0;
+    chat_msg_t msg;
+    pthread_rwlock_rdlock(&lock);
+    if (!cap) { pthread_rwlock_unlock(&lock); return 0; }
+    size_t i = seek_time(since_ms);
+    if (tail) {
+        /* Walk back to the limit-th newest match, then forward from there. */
+        size_t j = next, found = 0;
+        while (j > i && found < limit) {
+            j--;
+            if (!room || col_room[j % cap] == room) found++;
+        }
+        i = j;
+    }
+    pthread_rwlock_unlock(&lock);
+
+    while (visited < limit) {
+        pthread_rwlock_rdlock(&lock);
+        if (i < first) i = first;
+        size_t end = i + CACHE_RENDER_CHUNK;
+        if (end > next) end = next;
+        for (; i < end && visited < limit; i++) {
+            if (room && col_room[i % cap] != room) continue;
+            fill_msg(i, &msg);
+            fn(&msg, ctx);
+            visited++;
+        }
+        int done = i >= next;
+        pthread_rwlock_unlock(&lock);
+        if (done) break;
+    }
+    return visited;
+}
+
+uint64_t cache_find(const unsigned char id[CHAT_ID_LEN]) {
+    uint64_t found = UINT64_MAX;
+    pthread_rwlock_rdlock(&lock);
+    /* Resumes are nearly always near the head, so scan newest first. */
+    for (size_t i = next; cap && i > first; i--) {
+        if (memcmp(col_id[(i - 1) % cap], id, CHAT_ID_LEN) == 0) { found = i; break; }
+    }
+    pthread_rwlock_unlock(&lock);
+    return found;
+}
+
+size_t cache_visit_from(uint64_t *pos, uint64_t upto, uint32_t room, size_t limit, cache_visit_fn fn, void *ctx) {
+    size_t visited = 0;
+    chat_msg_t msg;
+    pthread_rwlock_rdlock(&lock);
+    size_t i = *pos < first ? first : (size_t)*pos;
+    size_t end = i + limit;
+    for (; cap && i < next && i < upto && i < end; i++) {
+        if (room && col_room[i % cap] != room) continue;
+        fill_msg(i, &msg);
+        fn(&msg, ctx);
+        visited++;
+    }
+    pthread_rwlock_unlock(&lock);
+    *pos = i;
+    return visited;
+}
+
+void cache_render(char *buffer, size_t buffer_size, uint64_t upto) {
+    cache_render_since(buffer, buffer_size, INT64_MIN, upto);
+}
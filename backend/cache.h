@@ -0,0 +1,53 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+#define CACHE_TEXT_MAX 4096
+
+/* In-memory history of the most recent messages in commit order, stored as
+ * columns plus a shared text arena (about 40 bytes per message besides the
+ * text itself). It subscribes to the commit stream, so local and remote
+ * commits land in it. Holds up to capacity messages and arena_bytes of text. */
+int cache_init(size_t capacity, size_t arena_bytes);
+void cache_append(const chat_msg_t *msg);
+
+/* Marked once warm-up has loaded the whole collection; while the ring has
+ * never wrapped, readers can be served without touching MongoDB. */
+void cache_set_complete(int complete);
+int cache_is_complete(void);
+
+/* True if a message with this id was cached at or after since_ms. */
+int cache_contains_recent(const unsigned char id[CHAT_ID_LEN], int64_t since_ms);
+
+/* Commit sequence: the number of messages ever appended. A reader that
+ * captures it renders a snapshot: nothing appended afterwards shows up. */
+#define CACHE_SEQ_NOW UINT64_MAX
+uint64_t cache_seq(void);
+
+/* Render the cached history (or the part at or after since_ms, found by
+ * binary search on the timestamp column) up to sequence upto as reader
+ * lines into buffer. */
+void cache_render(char *buffer, size_t buffer_size, uint64_t upto);
+void cache_render_since(char *buffer, size_t buffer_size, int64_t since_ms, uint64_t upto);
+
+/* Call fn for up to limit cached messages of room (0: any room) with
+ * ts >= since_ms, oldest first, or for the newest limit of them when tail
+ * is set. fn runs under the cache's read lock, so it must only copy; the
+ * message's pointers are valid until it returns. Returns how many were
+ * visited. */
+typedef void (*cache_visit_fn)(const chat_msg_t *msg, void *ctx);
+size_t cache_visit(int64_t since_ms, uint32_t room, size_t limit, int tail, cache_visit_fn fn, void *ctx);
+
+/* Cursor walk for resuming a stream: cache_find gives the sequence number
+ * just past the message with this id (UINT64_MAX if it is no longer
+ * cached); cache_visit_from then looks at up to limit messages from *pos,
+ * stopping before upto, visits those in room (0: any) and advances *pos.
+ * Messages evicted in the meantime are skipped. */
+uint64_t cache_find(const unsigned char id[CHAT_ID_LEN]);
+size_t cache_visit_from(uint64_t *pos, uint64_t upto, uint32_t room, size_t limit, cache_visit_fn fn, void *ctx);
+
+#endif
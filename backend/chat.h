@@ -0,0 +1,47 @@
+#ifndef CHAT_H
+#define CHAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHAT_ID_LEN 12   /* raw ObjectId bytes */
+#define CHAT_ROOM_MAX 64
+#define CHAT_DEFAULT_ROOM "general"
+
+/* A message as it leaves the write path. Pointers are only valid for the
+ * duration of a commit listener call; listeners copy what they keep. */
+typedef struct chat_msg {
+    const char *text;
+    size_t len;
+    int64_t ts_ms;
+    unsigned char id[CHAT_ID_LEN];
+    int remote;          /* committed by another server sharing the DB */
+    uint32_t room;       /* interned name; 0 means CHAT_DEFAULT_ROOM */
+    uint32_t author;     /* interned user name; 0 if the writer set none */
+} chat_msg_t;
+
+/* Commit stream: listeners are called on the writer's thread (or the sync
+ * thread for remote commits) after the message is stored, so they must not
+ * block. */
+typedef void (*commit_listener_fn)(const chat_msg_t *msg, void *ctx);
+
+int commit_subscribe(commit_listener_fn fn, void *ctx);
+void commit_publish(const chat_msg_t *msg);
+
+/* "[YYYY-mm-dd HH:MM:SS] text\n", or "[...] author: text\n" when the message
+ * has an author: the line format readers receive. Returns the length written
+ * (truncated to size - 1). */
+size_t chat_format_line(char *out, size_t size, int64_t ts_ms, uint32_t author, const char *text, size_t len);
+/* The same, for an author known by name (NULL if none) rather than id. */
+size_t chat_format_line_as(char *out, size_t size, int64_t ts_ms, const char *author, size_t author_len,
+                           const char *text, size_t len);
+
+/* {"id":"<hex>","ts":...,"room":"...","author":"...","message":"..."} with
+ * JSON string escaping; "author" only when the message has one. out must
+ * hold chat_json_max(msg) bytes; returns the length written, excluding the
+ * terminating NUL. */
+size_t chat_json_max(const chat_msg_t *msg);
+char *chat_json_escape(char *out, const char *s, size_t len);   /* up to 6 * len bytes */
+size_t chat_format_json(char *out, const chat_msg_t *msg);
+
+#endif
@@ -2,20 +2,272 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 4096        /* the server's line limit, newline included */
+#define OUT_BUFFER_SIZE 65536
+#define BULK_WINDOW 64
 
-int main() {
+/* Writer sessions run the server's pipelined mode: every command line gets
+ * one reply line, in order. Up to window commands may be unacknowledged;
+ * a separate thread reads the acks as they arrive. */
+typedef struct ack_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sock;
+    int window;
+    int in_flight;
+    int closed;             /* the server hung up */
+    int verbose;            /* print every ack, not just errors */
+    long *line_no;          /* input line of each in-flight command (0: start
+                             * or stop), a ring */
+    long acked, errors;
+} ack_state_t;
+
+static int send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void *ack_reader(void *arg) {
+    ack_state_t *a = arg;
+    char buf[BUFFER_SIZE], line[BUFFER_SIZE];
+    size_t line_len = 0;
+    ssize_t n;
+
+    while ((n = recv(a->sock, buf, sizeof(buf), 0)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] != '\n') {
+                if (line_len < sizeof(line) - 1) line[line_len++] = buf[i];
+                continue;
+            }
+            line[line_len] = '\0';
+            line_len = 0;
+            pthread_mutex_lock(&a->lock);
+            long no = a->line_no[a->acked % a->window];
+            int error = strncmp(line, "OK", 2) != 0;
+            a->acked++;
+            if (error) a->errors++;
+            if (a->in_flight > 0) a->in_flight--;
+            pthread_cond_signal(&a->cond);
+            pthread_mutex_unlock(&a->lock);
+            if (a->verbose) printf("%s\n", line);
+            else if (error && no > 0) fprintf(stderr, "line %ld: %s\n", no, line);
+            else if (error) fprintf(stderr, "%s\n", line);
+        }
+    }
+    pthread_mutex_lock(&a->lock);
+    a->closed = 1;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+/* Wait until fewer than limit commands are unacknowledged; 0 if the
+ * connection went away first. */
+static int wait_in_flight(ack_state_t *a, int limit) {
+    pthread_mutex_lock(&a->lock);
+    while (a->in_flight >= limit && !a->closed) pthread_cond_wait(&a->cond, &a->lock);
+    int ok = !a->closed;
+    pthread_mutex_unlock(&a->lock);
+    return ok;
+}
+
+static double now_sec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+/* Feed writer commands from in: typed ones (interactive) or a whole file
+ * wrapped in start/stop (bulk). Commands are batched into as few sends as
+ * the window allows. Returns the process exit status. */
+static int run_writer(int sock, FILE *in, int interactive, int window) {
+    static char out[OUT_BUFFER_SIZE];
+    size_t out_len = 0;
+    char buffer[BUFFER_SIZE + 1];
+    char reply[64];
+    size_t got = 0;
+
+    /* Switch to pipelined mode, and make sure the server knows it. */
+    if (send_all(sock, "writer\npipeline\n", 16) != 0) { printf("\nSend failed\n"); return 1; }
+    while (got < sizeof(reply) - 1 && (got == 0 || reply[got - 1] != '\n')) {
+        ssize_t n = recv(sock, reply + got, 1, 0);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    reply[got] = '\0';
+    if (strcmp(reply, "OK: pipelined\n") != 0) {
+        printf("\nServer does not support pipelined writers: %s\n", got ? reply : "(no reply)");
+        return 1;
+    }
+
+    ack_state_t a;
+    memset(&a, 0, sizeof(a));
+    pthread_mutex_init(&a.lock, NULL);
+    pthread_cond_init(&a.cond, NULL);
+    a.sock = sock;
+    a.window = window;
+    a.verbose = interactive;
+    a.line_no = calloc((size_t)window, sizeof(long));
+    pthread_t tid;
+    if (!a.line_no || pthread_create(&tid, NULL, ack_reader, &a) != 0) {
+        printf("\nOut of resources\n");
+        free(a.line_no);
+        return 1;
+    }
+
+    if (interactive) printf("You are Writer. Type messages (type 'exit' to quit)\n");
+    double started = now_sec();
+    long line_no = 0, sent = 0, skipped = 0;
+    int done = 0, bulk_stage = interactive ? 1 : 0;
+
+    while (!done) {
+        /* Bulk input is bracketed by start and stop. */
+        const char *cmd;
+        long cmd_line = 0;
+        if (bulk_stage == 0) {
+            cmd = "start";
+            bulk_stage = 1;
+        } else {
+            if (interactive) {
+                /* With a window of one, each ack shows before the next prompt. */
+                if (!wait_in_flight(&a, window)) break;
+                printf("Enter message: ");
+                fflush(stdout);
+            }
+            if (!fgets(buffer, sizeof(buffer), in)) {
+                if (interactive || bulk_stage == 2) break;
+                cmd = "stop";
+                bulk_stage = 2;
+            } else {
+                line_no++;
+                size_t len = strcspn(buffer, "\n");
+                if (buffer[len] != '\n' && !feof(in)) {
+                    /* Longer than the server accepts: skip the rest of it. */
+                    int c;
+                    while ((c = fgetc(in)) != EOF && c != '\n') { }
+                    fprintf(stderr, "line %ld: longer than %d bytes, skipped\n", line_no, BUFFER_SIZE - 1);
+                    skipped++;
+                    continue;
+                }
+                buffer[len] = '\0';
+                if (len > 0 && buffer[len - 1] == '\r') buffer[--len] = '\0';
+                if (len == 0) continue;     /* the server ignores empty lines */
+                cmd = buffer;
+                cmd_line = line_no;
+                done = interactive && strcmp(buffer, "exit") == 0;
+            }
+        }
+
+        size_t len = strlen(cmd);
+        if (out_len + len + 1 > sizeof(out)) {
+            if (send_all(sock, out, out_len) != 0) break;
+            out_len = 0;
+        }
+        if (!done) {
+            /* Flush what's batched before blocking on the window. */
+            pthread_mutex_lock(&a.lock);
+            int full = a.in_flight >= window;
+            pthread_mutex_unlock(&a.lock);
+            if (full && out_len > 0) {
+                if (send_all(sock, out, out_len) != 0) break;
+                out_len = 0;
+            }
+            if (!wait_in_flight(&a, window)) break;
+            pthread_mutex_lock(&a.lock);
+            a.line_no[(a.acked + a.in_flight) % window] = cmd_line;
+            a.in_flight++;
+            pthread_mutex_unlock(&a.lock);
+            sent++;
+        }
+        memcpy(out + out_len, cmd, len);
+        out[out_len + len] = '\n';
+        out_len += len + 1;
+        if (interactive || bulk_stage == 2) {
+            if (send_all(sock, out, out_len) != 0) break;
+            out_len = 0;
+        }
+    }
+    if (out_len > 0) send_all(sock, out, out_len);
+
+    /* Every ack is in before the session ends. */
+    wait_in_flight(&a, 1);
+    shutdown(sock, SHUT_WR);
+    pthread_join(tid, NULL);
+
+    if (a.acked < sent) fprintf(stderr, "Connection closed with %ld commands unacknowledged\n", sent - a.acked);
+    if (!interactive) {
+        double secs = now_sec() - started;
+        fprintf(stderr, "%ld commands acknowledged, %ld errors, %ld lines skipped in %.2f s (%.0f/s)\n",
+                a.acked, a.errors, skipped, secs, secs > 0 ? (double)a.acked / secs : 0.0);
+    }
+    int status = a.acked < sent || (!interactive && (a.errors > 0 || skipped > 0)) ? 1 : 0;
+    free(a.line_no);
+    pthread_mutex_destroy(&a.lock);
+    pthread_cond_destroy(&a.cond);
+    return status;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-w window] [-f file] [reader|writer]\n"
+            "  -w window  commands a writer may have unacknowledged (default 1,\n"
+            "             or %d with -f)\n"
+            "  -f file    post every line of file (- for stdin) in one writer\n"
+            "             session, as fast as the server acknowledges them\n",
+            prog, BULK_WINDOW);
+}
+
+int main(int argc, char **argv) {
     int sock = 0;
     struct sockaddr_in serv_addr;
     char buffer[BUFFER_SIZE] = {0};
-    char mode[10];
+    char mode[10] = {0};
+    const char *file = NULL;
+    int window = 0, opt;
 
-    printf("Enter mode (reader/writer): ");
-    scanf("%s", mode);
-    getchar(); // clear newline
+    while ((opt = getopt(argc, argv, "w:f:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            if (window <= 0) { usage(argv[0]); return 2; }
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind < argc) {
+        snprintf(mode, sizeof(mode), "%s", argv[optind]);
+    } else if (file) {
+        strcpy(mode, "writer");
+    } else {
+        printf("Enter mode (reader/writer): ");
+        if (scanf("%9s", mode) != 1) return -1;
+        getchar(); // clear newline
+    }
+    if (file && strcmp(mode, "writer") != 0) { usage(argv[0]); return 2; }
+    if (window == 0) window = file ? BULK_WINDOW : 1;
+
+    FILE *in = stdin;
+    if (file && strcmp(file, "-") != 0 && !(in = fopen(file, "r"))) {
+        perror(file);
+        return 1;
+    }
 
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         printf("\nSocket creation error\n");
@@ -35,25 +287,18 @@ int main() {
         return -1;
     }
 
-    send(sock, mode, sizeof(mode), 0);
-
+    int status = 0;
     if (strcmp(mode, "writer") == 0) {
-        printf("You are Writer. Type messages (type 'exit' to quit)\n");
-        while (1) {
-            printf("Enter message: ");
-            fgets(buffer, sizeof(buffer), stdin);
-            buffer[strcspn(buffer, "\n")] = 0;
-            send(sock, buffer, strlen(buffer), 0);
-            if (strcmp(buffer, "exit") == 0)
-                break;
-        }
+        status = run_writer(sock, in, file == NULL, window);
     } else {
+        send(sock, mode, sizeof(mode), 0);
         printf("You are Reader. Waiting for data...\n");
-        int bytes = recv(sock, buffer, sizeof(buffer), 0);
-        buffer[bytes] = '\0';
+        int bytes = recv(sock, buffer, sizeof(buffer) - 1, 0);
+        buffer[bytes > 0 ? bytes : 0] = '\0';
         printf("\n--- Chat Messages ---\n%s\n", buffer);
     }
 
+    if (in != stdin) fclose(in);
     close(sock);
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
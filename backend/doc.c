@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "doc.h"
+
+#define DOC_BATCH_SIZE 1000
+
+int chat_doc_decode(const bson_t *doc, chat_doc_t *out) {
+    bson_iter_t it;
+    memset(out, 0, sizeof(*out));
+    if (!bson_iter_init(&it, doc)) return -1;
+    while (bson_iter_next(&it)) {
+        const char *key = bson_iter_key(&it);
+        switch (key[0]) {
+        case '_':
+            if (strcmp(key, "_id") == 0 && BSON_ITER_HOLDS_OID(&it)) out->id = bson_iter_oid(&it);
+            break;
+        case 'm':
+            if (strcmp(key, "message") == 0 && BSON_ITER_HOLDS_UTF8(&it)) out->text = bson_iter_utf8(&it, &out->len);
+            break;
+        case 't':
+            if (strcmp(key, "timestamp") == 0 && BSON_ITER_HOLDS_DATE_TIME(&it)) out->ts_ms = bson_iter_date_time(&it);
+            break;
+        case 's':
+            if (strcmp(key, "stored") == 0 && BSON_ITER_HOLDS_DATE_TIME(&it)) out->stored_ms = bson_iter_date_time(&it);
+            break;
+        case 'r':
+            if (strcmp(key, "room") == 0 && BSON_ITER_HOLDS_UTF8(&it)) out->room = bson_iter_utf8(&it, &out->room_len);
+            break;
+        case 'a':
+            if (strcmp(key, "author") == 0 && BSON_ITER_HOLDS_UTF8(&it)) out->author = bson_iter_utf8(&it, &out->author_len);
+            break;
+        }
+    }
+    return 0;
+}
+
+void chat_doc_append_read_opts(bson_t *opts) {
+    bson_t projection;
+    BSON_APPEND_DOCUMENT_BEGIN(opts, "projection", &projection);
+    BSON_APPEND_INT32(&projection, "message", 1);
+    BSON_APPEND_INT32(&projection, "timestamp", 1);
+    BSON_APPEND_INT32(&projection, "room", 1);
+    BSON_APPEND_INT32(&projection, "author", 1);
+    BSON_APPEND_INT32(&projection, "stored", 1);
+    bson_append_document_end(opts, &projection);
+    BSON_APPEND_INT32(opts, "batchSize", DOC_BATCH_SIZE);
+}
@@ -0,0 +1,30 @@
+#ifndef DOC_H
+#define DOC_H
+
+#include <stdint.h>
+#include <bson/bson.h>
+
+/* A chatdb.chat document decoded in one pass over its fields. Pointers
+ * reference the BSON buffer and live as long as the document does. */
+typedef struct chat_doc {
+    const bson_oid_t *id;
+    const char *text;
+    uint32_t len;
+    int64_t ts_ms;
+    int64_t stored_ms;          /* when the insert happened; 0 if unknown */
+    const char *room;
+    uint32_t room_len;
+    const char *author;
+    uint32_t author_len;
+} chat_doc_t;
+
+/* Fields missing or of the wrong type are left NULL/0. Returns 0, or -1 for
+ * a corrupt document. */
+int chat_doc_decode(const bson_t *doc, chat_doc_t *out);
+
+/* Find options shared by history reads: only the fields the decoder looks
+ * at, in large batches so the cursor walks documents in place inside each
+ * reply instead of making a round trip per small batch. */
+void chat_doc_append_read_opts(bson_t *opts);
+
+#endif
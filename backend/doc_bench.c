@@ -0,0 +1,102 @@
+/* Per-document decode cost of history reads, without a server. The old read
+ * loop looked up "message" and "timestamp" with one bson_iter_init_find()
+ * each; chat_doc_decode() takes the same two fields (and the rest) from one
+ * walk. Both run over the same documents and fold the same two fields into
+ * a checksum, once for a document as stored and once as projected by
+ * chat_doc_append_read_opts().
+ *
+ *   make doc_bench && ./doc_bench [documents] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "doc.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Fields in the order the server inserts them; a projected document drops
+ * the idempotency key. */
+static void make_doc(bson_t *doc, int i, int projected) {
+    char text[128], room[32];
+    bson_oid_t oid;
+    bson_oid_init(&oid, NULL);
+    snprintf(text, sizeof(text), "message %d from the decode benchmark, about as long as a chat line", i);
+    snprintf(room, sizeof(room), "room-%d", i % 16);
+    bson_init(doc);
+    BSON_APPEND_OID(doc, "_id", &oid);
+    BSON_APPEND_UTF8(doc, "message", text);
+    BSON_APPEND_DATE_TIME(doc, "timestamp", 1700000000000LL + i);
+    BSON_APPEND_DATE_TIME(doc, "stored", 1700000000000LL + i);
+    BSON_APPEND_UTF8(doc, "room", room);
+    BSON_APPEND_UTF8(doc, "author", "bench");
+    if (!projected) BSON_APPEND_UTF8(doc, "key", "0123456789abcdef");
+}
+
+static double run_find(bson_t *docs, int count, int rounds, unsigned long *sum) {
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            bson_iter_t it;
+            uint32_t len = 0;
+            if (bson_iter_init_find(&it, &docs[i], "message") && BSON_ITER_HOLDS_UTF8(&it)) {
+                bson_iter_utf8(&it, &len);
+                *sum += len;
+            }
+            if (bson_iter_init_find(&it, &docs[i], "timestamp") && BSON_ITER_HOLDS_DATE_TIME(&it))
+                *sum += (unsigned long)bson_iter_date_time(&it);
+        }
+    }
+    return now_sec() - start;
+}
+
+static double run_decode(bson_t *docs, int count, int rounds, unsigned long *sum) {
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            chat_doc_t d;
+            if (chat_doc_decode(&docs[i], &d) != 0) continue;
+            if (d.text) *sum += d.len;
+            *sum += (unsigned long)d.ts_ms;
+        }
+    }
+    return now_sec() - start;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100;
+    if (count <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [documents] [rounds]\n", argv[0]);
+        return 2;
+    }
+    bson_t *docs = malloc((size_t)count * sizeof(*docs));
+    if (!docs) return 1;
+
+    static const char *shapes[] = { "stored", "projected" };
+    double n = (double)count * rounds;
+    int ok = 1;
+    printf("%d documents x %d rounds, ns/doc for message + timestamp\n", count, rounds);
+    printf("  %-10s %22s %16s\n", "document", "bson_iter_init_find x2", "chat_doc_decode");
+    for (int projected = 0; projected < 2; projected++) {
+        for (int i = 0; i < count; i++) make_doc(&docs[i], i, projected);
+        /* The checksums keep either loop from being optimized out, and
+         * prove both read the same values. */
+        unsigned long sum_find = 0, sum_decode = 0;
+        double find_sec = run_find(docs, count, rounds, &sum_find);
+        double decode_sec = run_decode(docs, count, rounds, &sum_decode);
+        printf("  %-10s %22.1f %16.1f\n", shapes[projected], find_sec / n * 1e9, decode_sec / n * 1e9);
+        if (sum_find != sum_decode) {
+            fprintf(stderr, "%s: checksums differ: %lu vs %lu\n", shapes[projected], sum_find, sum_decode);
+            ok = 0;
+        }
+        for (int i = 0; i < count; i++) bson_destroy(&docs[i]);
+    }
+    free(docs);
+    return ok ? 0 : 1;
+}
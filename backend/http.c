@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "chat.h"
+#include "cache.h"
+#include "http.h"
+#include "net.h"
+#include "rooms.h"
+#include "subscriber.h"
+
+#define HTTP_OUT_MAX 16384
+#define HTTP_LIMIT_DEFAULT 100
+#define HTTP_LIMIT_MAX 1000
+#define HTTP_FIELD_MAX 128
+/* Same as a TCP writer's line, so every path stores the same text. */
+#define HTTP_MESSAGE_MAX (CACHE_TEXT_MAX - 1)
+
+static http_post_fn post_handler = NULL;
+static http_room_fn room_handler = NULL;
+static int idle_ms = 30000;
+
+/* A parsed request. Every pointer is into the connection buffer. */
+typedef struct http_req {
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    char *query;
+    size_t query_len;
+    char *body;
+    size_t body_len;
+    const char *content_type;
+    size_t content_type_len;
+    const char *last_event_id;
+    size_t last_event_id_len;
+    int keep_alive;
+    int chunked;
+} http_req_t;
+
+/* Responses queued for one send; pipelined requests share it. */
+typedef struct http_out {
+    int sock;
+    size_t len;
+    int failed;
+    char data[HTTP_OUT_MAX];
+} http_out_t;
+
+static const char *methods[] = { "GET ", "POST ", "PUT ", "DELETE ", "HEAD ", "OPTIONS ", "PATCH " };
+
+int http_detect(const char *buf, size_t len) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        size_t n = strlen(methods[i]);
+        if (len > n && memcmp(buf, methods[i], n) == 0 && buf[n] == '/') return 1;
+    }
+    return 0;
+}
+
+void http_init(http_post_fn post, http_room_fn room) {
+    post_handler = post;
+    room_handler = room;
+    const char *env = getenv("CHAT_HTTP_IDLE_SEC");
+    if (env && atoi(env) > 0) idle_ms = atoi(env) * 1000;
+}
+
+static int header_is(const char *name, size_t len, const char *want) {
+    return strlen(want) == len && strncasecmp(name, want, len) == 0;
+}
+
+static int value_has(const char *v, size_t len, const char *token) {
+    size_t n = strlen(token);
+    for (size_t i = 0; i + n <= len; i++)
+        if (strncasecmp(v + i, token, n) == 0) return 1;
+    return 0;
+}
+
+/* Parse one request from buf[0..len). Returns its total length (head and
+ * body), 0 if it isn't complete yet, -1 if it is malformed. */
+static long http_parse(char *buf, size_t len, http_req_t *req) {
+    char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!end) return 0;
+    size_t head_len = (size_t)(end - buf) + 4;
+    memset(req, 0, sizeof(*req));
+
+    /* Request line: METHOD SP target SP HTTP/1.x */
+    char *line_end = memmem(buf, head_len, "\r\n", 2);
+    char *sp1 = memchr(buf, ' ', (size_t)(line_end - buf));
+    if (!sp1) return -1;
+    char *sp2 = memchr(sp1 + 1, ' ', (size_t)(line_end - sp1 - 1));
+    if (!sp2 || line_end - sp2 != 9 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) return -1;
+    int minor = sp2[8] - '0';
+    req->method = buf;
+    req->method_len = (size_t)(sp1 - buf);
+    req->path = sp1 + 1;
+    char *q = memchr(sp1 + 1, '?', (size_t)(sp2 - sp1 - 1));
+    req->path_len = (size_t)((q ? q : sp2) - req->path);
+    if (q) { req->query = q + 1; req->query_len = (size_t)(sp2 - q - 1); }
+    req->keep_alive = minor >= 1;
+
+    long content_length = 0;
+    for (char *h = line_end + 2; h < end; ) {
+        char *eol = memmem(h, (size_t)(end + 2 - h), "\r\n", 2);
+        char *colon = memchr(h, ':', (size_t)(eol - h));
+        if (!colon) return -1;
+        char *v = colon + 1;
+        while (v < eol && (*v == ' ' || *v == '\t')) v++;
+        size_t name_len = (size_t)(colon - h), vlen = (size_t)(eol - v);
+        if (header_is(h, name_len, "Content-Length")) {
+            content_length = 0;
+            for (size_t i = 0; i < vlen; i++) {
+                if (v[i] < '0' || v[i] > '9' || content_length > HTTP_REQUEST_MAX) return -1;
+                content_length = content_length * 10 + (v[i] - '0');
+            }
+        } else if (header_is(h, name_len, "Connection")) {
+            if (value_has(v, vlen, "close")) req->keep_alive = 0;
+            else if (value_has(v, vlen, "keep-alive")) req->keep_alive = 1;
+        } else if (header_is(h, name_len, "Transfer-Encoding")) {
+            req->chunked = 1;
+        } else if (header_is(h, name_len, "Content-Type")) {
+            req->content_type = v;
+            req->content_type_len = vlen;
+        } else if (header_is(h, name_len, "Last-Event-ID")) {
+            req->last_event_id = v;
+            req->last_event_id_len = vlen;
+        }
+        h = eol + 2;
+    }
+    if (head_len + (size_t)content_length > HTTP_REQUEST_MAX) return -1;
+    if (len < head_len + (size_t)content_length) return 0;
+    req->body = buf + head_len;
+    req->body_len = (size_t)content_length;
+    return (long)(head_len + (size_t)content_length);
+}
+
+static void out_flush(http_out_t *out) {
+    size_t off = 0;
+    while (off < out->len && !out->failed) {
+        ssize_t n = send(out->sock, out->data + off, out->len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) out->failed = 1;
+        else off += (size_t)n;
+    }
+    out->len = 0;
+}
+
+static const char *status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+static void respond(http_out_t *out, int status, const char *body, size_t len, int keep_alive) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+                     "Access-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n",
+                     status, status_text(status), len, keep_alive ? "keep-alive" : "close");
+    if (out->len + (size_t)n + len > sizeof(out->data)) out_flush(out);
+    if ((size_t)n + len > sizeof(out->data)) {
+        /* Too big to queue: straight out behind whatever was queued. */
+        struct iovec iov[2] = { { head, (size_t)n }, { (void *)body, len } };
+        if (!out->failed && net_sendv(out->sock, iov, 2) != 0) out->failed = 1;
+        return;
+    }
+    memcpy(out->data + out->len, head, (size_t)n);
+    memcpy(out->data + out->len + n, body, len);
+    out->len += (size_t)n + len;
+}
+
+/* {"ok":false,"error":"..."} or {"ok":true,"reply":"..."} from a protocol
+ * reply line. */
+static void respond_reply(http_out_t *out, int status, const char *reply, int keep_alive) {
+    int ok = strncmp(reply, "OK: ", 4) == 0;
+    const char *text = ok ? reply + 4 : strncmp(reply, "ERROR: ", 7) == 0 ? reply + 7 : reply;
+    size_t len = strcspn(text, "\n");
+    if (len > 200) len = 200;
+    char body[1300];
+    char *p = body + sprintf(body, "{\"ok\":%s,\"%s\":\"", ok ? "true" : "false", ok ? "reply" : "error");
+    p = chat_json_escape(p, text, len);
+    *p++ = '"'; *p++ = '}';
+    respond(out, status, body, (size_t)(p - body), keep_alive);
+}
+
+static void respond_error(http_out_t *out, int status, const char *error, int keep_alive) {
+    char reply[160];
+    snprintf(reply, sizeof(reply), "ERROR: %s", error);
+    respond_reply(out, status, reply, keep_alive);
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Percent-decode query parameter name into out (NUL-terminated). Returns
+ * 1 if present. */
+static int query_param(const char *q, size_t qlen, const char *name, char *out, size_t size) {
+    size_t nlen = strlen(name);
+    const char *end = q + qlen;
+    for (const char *p = q; p && p < end; ) {
+        const char *amp = memchr(p, '&', (size_t)(end - p));
+        const char *stop = amp ? amp : end;
+        if ((size_t)(stop - p) > nlen && strncmp(p, name, nlen) == 0 && p[nlen] == '=') {
+            size_t o = 0;
+            for (const char *v = p + nlen + 1; v < stop && o + 1 < size; v++) {
+                if (*v == '+') out[o++] = ' ';
+                else if (*v == '%' && stop - v > 2 && hexval(v[1]) >= 0 && hexval(v[2]) >= 0) { out[o++] = (char)(hexval(v[1]) << 4 | hexval(v[2])); v += 2; }
+                else out[o++] = *v;
+            }
+            out[o] = '\0';
+            return 1;
+        }
+        p = amp ? amp + 1 : NULL;
+    }
+    return 0;
+}
+
+static char *put_utf8(char *w, unsigned cp) {
+    if (cp < 0x80) { *w++ = (char)cp; }
+    else if (cp < 0x800) { *w++ = (char)(0xC0 | cp >> 6); *w++ = (char)(0x80 | (cp & 0x3F)); }
+    else if (cp < 0x10000) { *w++ = (char)(0xE0 | cp >> 12); *w++ = (char)(0x80 | (cp >> 6 & 0x3F)); *w++ = (char)(0x80 | (cp & 0x3F)); }
+    else { *w++ = (char)(0xF0 | cp >> 18); *w++ = (char)(0x80 | (cp >> 12 & 0x3F)); *w++ = (char)(0x80 | (cp >> 6 & 0x3F)); *w++ = (char)(0x80 | (cp & 0x3F)); }
+    return w;
+}
+
+static int read_hex4(const char *p, const char *end, unsigned *cp) {
+    if (end - p < 4) return -1;
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hexval(p[i]);
+        if (h < 0) return -1;
+        *cp = *cp << 4 | (unsigned)h;
+    }
+    return 0;
+}
+
+/* Decode the JSON string starting after the opening quote at *pp, in
+ * place: unescaped text never outgrows its source. Leaves *pp after the
+ * closing quote. Returns the NUL-terminated string, or NULL. */
+static char *json_string(char **pp, char *end, size_t *out_len) {
+    char *r = *pp, *w = *pp, *start = *pp;
+    while (r < end && *r != '"') {
+        if (*r != '\\') { *w++ = *r++; continue; }
+        if (++r == end) return NULL;
+        char c = *r++;
+        switch (c) {
+        case '"': case '\\': case '/': *w++ = c; break;
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case 'n': *w++ = '\n'; break;
+        case 'r': *w++ = '\r'; break;
+        case 't': *w++ = '\t'; break;
+        case 'u': {
+            unsigned cp, lo;
+            if (read_hex4(r, end, &cp) != 0) return NULL;
+            r += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && end - r >= 6 && r[0] == '\\' && r[1] == 'u'
+                && read_hex4(r + 2, end, &lo) == 0 && lo >= 0xDC00 && lo < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                r += 6;
+            }
+            w = put_utf8(w, cp);
+            break;
+        }
+        default: return NULL;
+        }
+    }
+    if (r == end) return NULL;
+    *w = '\0';   /* w <= r, and r is the closing quote */
+    *pp = r + 1;
+    if (out_len) *out_len = (size_t)(w - start);
+    return start;
+}
+
+static char *skip_ws(char *p, char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+/* A flat object of string members, decoded in place into post. */
+static int parse_json_post(char *body, size_t len, http_post_t *post) {
+    char *p = body, *end = body + len;
+    p = skip_ws(p, end);
+    if (p == end || *p++ != '{') return -1;
+    p = skip_ws(p, end);
+    if (p < end && *p == '}') return 0;
+    for (;;) {
+        if (p == end || *p++ != '"') return -1;
+        char *name = json_string(&p, end, NULL);
+        if (!name) return -1;
+        p = skip_ws(p, end);
+        if (p == end || *p++ != ':') return -1;
+        p = skip_ws(p, end);
+        if (p == end || *p++ != '"') return -1;
+        size_t vlen;
+        char *value = json_string(&p, end, &vlen);
+        if (!value) return -1;
+        if (strcmp(name, "message") == 0) { post->message = value; post->message_len = vlen; }
+        else if (strcmp(name, "room") == 0) post->room = value;
+        else if (strcmp(name, "user") == 0) post->user = value;
+        else if (strcmp(name, "key") == 0) post->key = value;
+        else if (strcmp(name, "class") == 0) post->cls = value;
+        p = skip_ws(p, end);
+        if (p < end && *p == ',') { p = skip_ws(p + 1, end); continue; }
+        if (p < end && *p == '}') return 0;
+        return -1;
+    }
+}
+
+static void post_messages(http_out_t *out, http_req_t *req) {
+    http_post_t post = { 0 };
+    char room[HTTP_FIELD_MAX], user[HTTP_FIELD_MAX], key[HTTP_FIELD_MAX], cls[HTTP_FIELD_MAX];
+    if (req->content_type && req->content_type_len >= 16 && strncasecmp(req->content_type, "application/json", 16) == 0) {
+        if (parse_json_post(req->body, req->body_len, &post) != 0) {
+            respond_error(out, 400, "body must be a JSON object of strings", req->keep_alive);
+            return;
+        }
+    } else {
+        /* Raw text body. It's the last thing in its request, so the byte
+         * after it can be borrowed for the terminator and restored. */
+        post.message = req->body;
+        post.message_len = req->body_len;
+        if (query_param(req->query, req->query_len, "room", room, sizeof(room))) post.room = room;
+        if (query_param(req->query, req->query_len, "user", user, sizeof(user))) post.user = user;
+        if (query_param(req->query, req->query_len, "key", key, sizeof(key))) post.key = key;
+        if (query_param(req->query, req->query_len, "class", cls, sizeof(cls))) post.cls = cls;
+    }
+    if (!post.message || post.message_len == 0) {
+        respond_error(out, 400, "empty message", req->keep_alive);
+        return;
+    }
+    if (post.message_len > HTTP_MESSAGE_MAX) {
+        respond_error(out, 413, "message longer than 4095 bytes", req->keep_alive);
+        return;
+    }
+    char saved = req->body[req->body_len];
+    int raw = post.message == req->body;
+    if (raw) req->body[req->body_len] = '\0';
+    char reply[256];
+    int status = post_handler(&post, reply, sizeof(reply));
+    if (raw) req->body[req->body_len] = saved;
+    respond_reply(out, status, reply, req->keep_alive);
+}
+
+typedef struct json_list {
+    char *buf;
+    size_t len, cap;
+    int count;
+    int failed;
+} json_list_t;
+
+static void list_append(const chat_msg_t *msg, void *ctx) {
+    json_list_t *l = ctx;
+    size_t need = l->len + chat_json_max(msg) + 4;
+    if (l->failed) return;
+    if (need > l->cap) {
+        size_t cap = l->cap * 2 > need ? l->cap * 2 : need;
+        char *grown = realloc(l->buf, cap);
+        if (!grown) { l->failed = 1; return; }
+        l->buf = grown;
+        l->cap = cap;
+    }
+    if (l->count++) l->buf[l->len++] = ',';
+    l->len += chat_format_json(l->buf + l->len, msg);
+}
+
+static int parse_id(const char *hex, size_t len, unsigned char id[CHAT_ID_LEN]) {
+    if (len != 2 * CHAT_ID_LEN) return -1;
+    for (int i = 0; i < CHAT_ID_LEN; i++) {
+        int hi = hexval(hex[2 * i]), lo = hexval(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return -1;
+        id[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+static void get_messages(http_out_t *out, http_req_t *req) {
+    char value[HTTP_FIELD_MAX];
+    int64_t since = INT64_MIN;
+    size_t limit = HTTP_LIMIT_DEFAULT;
+    uint32_t room = 0;
+    int tail = 1;
+    uint64_t after = UINT64_MAX;
+    if (query_param(req->query, req->query_len, "since", value, sizeof(value))) {
+        char *e;
+        since = strtoll(value, &e, 10);
+        if (*e || !*value) { respond_error(out, 400, "since must be a millisecond timestamp", req->keep_alive); return; }
+        tail = 0;
+    }
+    if (query_param(req->query, req->query_len, "limit", value, sizeof(value))) {
+        long n = atol(value);
+        if (n <= 0) { respond_error(out, 400, "limit must be positive", req->keep_alive); return; }
+        limit = n > HTTP_LIMIT_MAX ? HTTP_LIMIT_MAX : (size_t)n;
+    }
+    if (query_param(req->query, req->query_len, "room", value, sizeof(value))) {
+        room = room_handler(value, 0);
+        if (!room) { respond_error(out, 400, "invalid room name", req->keep_alive); return; }
+    }
+    if (query_param(req->query, req->query_len, "after", value, sizeof(value))) {
+        unsigned char id[CHAT_ID_LEN];
+        if (parse_id(value, strlen(value), id) != 0) { respond_error(out, 400, "invalid after id", req->keep_alive); return; }
+        after = cache_find(id);
+        if (after == UINT64_MAX) { respond_error(out, 410, "message no longer cached", req->keep_alive); return; }
+    }
+
+    json_list_t list = { NULL, 0, 0, 0, 0 };
+    list.cap = 4096;
+    list.buf = malloc(list.cap);
+    if (!list.buf) { respond_error(out, 503, "out of memory", req->keep_alive); return; }
+    list.len = (size_t)sprintf(list.buf, "{\"messages\":[");
+    if (room == HTTP_ROOM_UNKNOWN) {
+        /* never written to: nothing to list */
+    } else if (after != UINT64_MAX) {
+        /* Each pass scans no more than are still wanted, so none overshoots. */
+        uint64_t upto = cache_seq();
+        while ((size_t)list.count < limit && after < upto) {
+            uint64_t from = after;
+            cache_visit_from(&after, upto, room, limit - (size_t)list.count, list_append, &list);
+            if (after == from) break;
+        }
+    } else {
+        cache_visit(since, room, limit, tail, list_append, &list);
+    }
+    if (list.failed || list.len + 3 > list.cap) {
+        char *grown = list.failed ? NULL : realloc(list.buf, list.len + 3);
+        if (!grown) { free(list.buf); respond_error(out, 503, "out of memory", req->keep_alive); return; }
+        list.buf = grown;
+    }
+    list.buf[list.len++] = ']';
+    list.buf[list.len++] = '}';
+    respond(out, 200, list.buf, list.len, req->keep_alive);
+    free(list.buf);
+}
+
+/* Hands the connection to the subscriber module; returns 0 if it did.
+ * A reconnecting EventSource resumes from its Last-Event-ID header; a
+ * first connection can ask for the same with ?last_event_id=. */
+static int get_stream(http_out_t *out, http_req_t *req) {
+    char value[HTTP_FIELD_MAX];
+    uint32_t room = 0;
+    if (query_param(req->query, req->query_len, "room", value, sizeof(value))) {
+        room = room_handler(value, 1);
+        if (!room) { respond_error(out, 400, "invalid room name", req->keep_alive); return -1; }
+        if (room == HTTP_ROOM_UNKNOWN) { respond_error(out, 503, "too many distinct names", req->keep_alive); return -1; }
+    }
+    unsigned char id[CHAT_ID_LEN];
+    const unsigned char *resume = NULL;
+    if (req->last_event_id) {
+        if (parse_id(req->last_event_id, req->last_event_id_len, id) != 0) { respond_error(out, 400, "invalid Last-Event-ID", req->keep_alive); return -1; }
+        resume = id;
+    } else if (query_param(req->query, req->query_len, "last_event_id", value, sizeof(value))) {
+        if (parse_id(value, strlen(value), id) != 0) { respond_error(out, 400, "invalid last_event_id", req->keep_alive); return -1; }
+        resume = id;
+    }
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n";
+    if (out->len + sizeof(head) - 1 > sizeof(out->data)) out_flush(out);
+    memcpy(out->data + out->len, head, sizeof(head) - 1);
+    out->len += sizeof(head) - 1;
+    out_flush(out);
+    if (out->failed) return -1;
+    int pinned = room && rooms_pin(room) == 0;
+    subscriber_serve(out->sock, room, SUB_SSE, resume);
+    if (pinned) rooms_unpin(room);
+    return 0;
+}
+
+static int path_is(const http_req_t *req, const char *path) {
+    return strlen(path) == req->path_len && memcmp(req->path, path, req->path_len) == 0;
+}
+
+static int method_is(const http_req_t *req, const char *m) {
+    return strlen(m) == req->method_len && memcmp(req->method, m, req->method_len) == 0;
+}
+
+/* Returns 1 if the connection now belongs to a stream. */
+static int route(http_out_t *out, http_req_t *req) {
+    if (path_is(req, "/messages")) {
+        if (method_is(req, "POST")) post_messages(out, req);
+        else if (method_is(req, "GET")) get_messages(out, req);
+        else respond_error(out, 405, "use GET or POST", req->keep_alive);
+    } else if (path_is(req, "/stream")) {
+        if (!method_is(req, "GET")) respond_error(out, 405, "use GET", req->keep_alive);
+        else return get_stream(out, req) == 0;
+    } else {
+        respond_error(out, 404, "no such resource", req->keep_alive);
+    }
+    return 0;
+}
+
+void http_serve(int sock, const char *initial, size_t len) {
+    char *buf = malloc(HTTP_REQUEST_MAX + 1);   /* + a borrowed terminator */
+    http_out_t *out = malloc(sizeof(*out));
+    if (!buf || !out || len > HTTP_REQUEST_MAX) { free(buf); free(out); close(sock); return; }
+    memcpy(buf, initial, len);
+    out->sock = sock;
+    out->len = 0;
+    out->failed = 0;
+    size_t used = len;
+    int open = 1;
+    unsigned long requests = 0;
+
+    while (open && !out->failed) {
+        /* Answer every complete request in the buffer, in order. */
+        size_t start = 0;
+        for (;;) {
+            http_req_t req;
+            long n = http_parse(buf + start, used - start, &req);
+            if (n == 0 && used == HTTP_REQUEST_MAX && start == 0) n = -1;
+            if (n == 0) break;
+            if (n < 0) { respond_error(out, 400, "malformed request", 0); open = 0; break; }
+            requests++;
+            if (req.chunked) { respond_error(out, 411, "chunked bodies are not supported", 0); open = 0; break; }
+            if (route(out, &req)) { free(buf); free(out); return; }
+            start += (size_t)n;
+            if (!req.keep_alive) { open = 0; break; }
+        }
+        out_flush(out);
+        if (!open) break;
+        memmove(buf, buf + start, used - start);
+        used -= start;
+
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ready = poll(&pfd, 1, idle_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) break;
+        ssize_t r = recv(sock, buf + used, HTTP_REQUEST_MAX - used, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        used += (size_t)r;
+    }
+    printf("[HTTP] Connection closed after %lu requests (sock=%d)\n", requests, sock);
+    close(sock);
+    free(buf);
+    free(out);
+}
@@ -0,0 +1,54 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* HTTP/1.1 on the chat port, recognised from the request line:
+ *
+ *   POST /messages             store a message; JSON body {"message": ...,
+ *                              "room", "user", "key", "class"} or, with any
+ *                              other Content-Type, the raw body as the text
+ *                              and the options as query parameters
+ *   GET /messages?since=&after=&limit=&room=
+ *                              {"messages": [...]} from the in-memory log:
+ *                              up to limit (default 100, max 1000) messages
+ *                              from since (ms) on, or following message id
+ *                              after (410 once it has left the log), or the
+ *                              newest ones
+ *   GET /stream?room=&last_event_id=
+ *                              committed messages as text/event-stream,
+ *                              resuming after Last-Event-ID when given
+ *
+ * Connections are kept alive and pipelined requests are answered in order,
+ * batched into as few sends as possible. Requests are parsed in place in the
+ * connection's buffer; bodies must carry a Content-Length and the whole
+ * request must fit in HTTP_REQUEST_MAX. CHAT_HTTP_IDLE_SEC closes idle
+ * keep-alive connections (default 30). */
+#define HTTP_REQUEST_MAX 65536
+
+typedef struct http_post {
+    const char *message;     /* NUL-terminated, may contain NULs before len */
+    size_t message_len;
+    const char *room, *user, *key, *cls;    /* NUL-terminated, or NULL */
+} http_post_t;
+
+/* Store one message: writes a protocol reply ("OK: ..." or "ERROR: ...")
+ * into reply and returns the HTTP status. */
+typedef int (*http_post_fn)(const http_post_t *post, char *reply, size_t size);
+/* Id of a room named in a request: 0 if the name is invalid,
+ * HTTP_ROOM_UNKNOWN if it has none. Only with follow set (streams, which
+ * may wait for a room's first message) may the name be given a new id. */
+#define HTTP_ROOM_UNKNOWN UINT32_MAX
+typedef uint32_t (*http_room_fn)(const char *name, int follow);
+
+void http_init(http_post_fn post, http_room_fn room);
+
+/* True if buf starts like an HTTP request line. */
+int http_detect(const char *buf, size_t len);
+
+/* Serve an HTTP connection whose first len bytes were already read into
+ * initial. Closes sock. */
+void http_serve(int sock, const char *initial, size_t len);
+
+#endif
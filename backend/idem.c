@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bloom.h"
+#include "idem.h"
+#include "mem.h"
+
+#define IDEM_BUCKETS 65536
+#define IDEM_EXPECTED_KEYS 100000     /* per window, sizes the Bloom filter */
+
+typedef struct idem_entry {
+    struct idem_entry *next;
+    uint64_t hash;
+    uint32_t len;
+    char key[];
+} idem_entry_t;
+
+/* gens[cur] takes new keys; gens[!cur] holds the previous window. */
+static idem_entry_t **gens[2];
+static int cur = 0;
+static int64_t cur_started = 0;
+static int64_t window_ms = 600000;
+static bloom_window_t *filter;
+static pthread_mutex_t idem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int idem_init(void) {
+    const char *env = getenv("CHAT_IDEM_WINDOW_SEC");
+    if (env && atol(env) > 0) window_ms = atol(env) * 1000L;
+    gens[0] = calloc(IDEM_BUCKETS, sizeof(*gens[0]));
+    gens[1] = calloc(IDEM_BUCKETS, sizeof(*gens[1]));
+    filter = bloom_window_new(IDEM_EXPECTED_KEYS, window_ms);
+    if (!gens[0] || !gens[1] || !filter) return -1;
+    cur_started = now_ms();
+    return 0;
+}
+
+int idem_valid_key(const char *key, size_t len) {
+    if (len == 0 || len > IDEM_KEY_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = key[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == ':')) return 0;
+    }
+    return 1;
+}
+
+static void free_gen(idem_entry_t **gen) {
+    for (size_t b = 0; b < IDEM_BUCKETS; b++) {
+        while (gen[b]) {
+            idem_entry_t *e = gen[b];
+            gen[b] = e->next;
+            mem_charge(MEM_IDEM, -(long)(sizeof(*e) + e->len));
+            free(e);
+        }
+    }
+}
+
+/* Caller holds idem_lock. */
+static idem_entry_t **find(idem_entry_t **gen, uint64_t h, const char *key, size_t len) {
+    idem_entry_t **pp = &gen[h % IDEM_BUCKETS];
+    for (; *pp; pp = &(*pp)->next)
+        if ((*pp)->hash == h && (*pp)->len == len && memcmp((*pp)->key, key, len) == 0) return pp;
+    return NULL;
+}
+
+int idem_claim(const char *key, size_t len) {
+    uint64_t h = bloom_hash(key, len);
+    int64_t now = now_ms();
+
+    pthread_mutex_lock(&idem_lock);
+    if (now - cur_started >= window_ms) {
+        cur = !cur;
+        free_gen(gens[cur]);
+        cur_started = now;
+    }
+    /* A new key is settled by one filter block; only "maybe" walks chains. */
+    if (bloom_window_maybe(filter, h, now - window_ms) && (find(gens[cur], h, key, len) || find(gens[!cur], h, key, len))) {
+        pthread_mutex_unlock(&idem_lock);
+        return 1;
+    }
+    idem_entry_t *e = malloc(sizeof(*e) + len);
+    if (e) {
+        e->hash = h;
+        e->len = (uint32_t)len;
+        memcpy(e->key, key, len);
+        e->next = gens[cur][h % IDEM_BUCKETS];
+        gens[cur][h % IDEM_BUCKETS] = e;
+        mem_charge(MEM_IDEM, (long)(sizeof(*e) + len));
+    }
+    bloom_window_add(filter, h, now);
+    pthread_mutex_unlock(&idem_lock);
+    return 0;
+}
+
+void idem_release(const char *key, size_t len) {
+    uint64_t h = bloom_hash(key, len);
+    pthread_mutex_lock(&idem_lock);
+    for (int g = 0; g < 2; g++) {
+        idem_entry_t **pp = find(gens[g], h, key, len);
+        if (!pp) continue;
+        idem_entry_t *e = *pp;
+        *pp = e->next;
+        mem_charge(MEM_IDEM, -(long)(sizeof(*e) + e->len));
+        free(e);
+    }
+    pthread_mutex_unlock(&idem_lock);
+}
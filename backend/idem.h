@@ -0,0 +1,27 @@
+#ifndef IDEM_H
+#define IDEM_H
+
+#include <stddef.h>
+
+#define IDEM_KEY_MAX 64
+
+/* Idempotency keys writers attach to messages ("@key:<k> text").
+ *
+ *   CHAT_IDEM_WINDOW_SEC   how long a key is remembered locally (default 600)
+ *
+ * Keys live in an exact table split into two time windows, with a blocked
+ * Bloom filter in front so a new key never probes the table. The unique
+ * index on the stored "key" field catches duplicates across servers and
+ * beyond the window. */
+int idem_init(void);
+
+/* Claim key for a message about to be written: 0 if it is new (now
+ * claimed), 1 if it was already claimed within the window. */
+int idem_claim(const char *key, size_t len);
+
+/* Drop a claim whose write did not happen, so a retry can succeed. */
+void idem_release(const char *key, size_t len);
+
+int idem_valid_key(const char *key, size_t len);
+
+#endif
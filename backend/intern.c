@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "intern.h"
+#include "mem.h"
+
+typedef struct intern_entry {
+    uint32_t hash;
+    uint32_t id;
+    uint32_t len;
+    char s[];
+} intern_entry_t;
+
+/* Open addressing with linear probing, at most half full. Slots only ever go
+ * from NULL to an entry, so readers probe with acquire loads and no lock;
+ * writers serialise on insert_lock and publish with a release store. */
+static _Atomic(intern_entry_t *) *slots;
+static size_t slot_mask;
+static _Atomic(intern_entry_t *) *by_id;     /* index = id */
+static size_t max_ids;
+static atomic_uint next_id = 1;
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_bytes(const char *s, size_t len) {
+    uint32_t h = 2166136261u;                 /* FNV-1a */
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)s[i]; h *= 16777619u; }
+    return h;
+}
+
+int intern_init(size_t max_strings) {
+    size_t n = 16;
+    while (n < max_strings * 2) n <<= 1;
+    slots = mem_alloc_large(MEM_INTERN, n * sizeof(*slots));
+    by_id = mem_alloc_large(MEM_INTERN, (max_strings + 1) * sizeof(*by_id));
+    if (!slots || !by_id) return -1;
+    slot_mask = n - 1;
+    max_ids = max_strings;
+    return 0;
+}
+
+static intern_entry_t *probe(const char *s, size_t len, uint32_t h, size_t *slot_out) {
+    size_t i = h & slot_mask;
+    for (;;) {
+        intern_entry_t *e = atomic_load_explicit(&slots[i], memory_order_acquire);
+        if (!e) { if (slot_out) *slot_out = i; return NULL; }
+        if (e->hash == h && e->len == len && memcmp(e->s, s, len) == 0) return e;
+        i = (i + 1) & slot_mask;
+    }
+}
+
+uint32_t intern_find(const char *s, size_t len) {
+    if (!slots) return 0;
+    intern_entry_t *e = probe(s, len, hash_bytes(s, len), NULL);
+    return e ? e->id : 0;
+}
+
+/* Insert with new ids allowed up to limit. */
+static uint32_t intern_upto(const char *s, size_t len, size_t limit) {
+    if (!slots) return 0;
+    uint32_t h = hash_bytes(s, len);
+    intern_entry_t *e = probe(s, len, h, NULL);
+    if (e) return e->id;
+
+    pthread_mutex_lock(&insert_lock);
+    size_t slot;
+    e = probe(s, len, h, &slot);              /* lost a race to another inserter? */
+    if (!e) {
+        uint32_t id = atomic_load(&next_id);
+        if (id > limit || !(e = malloc(sizeof(*e) + len + 1))) {
+            pthread_mutex_unlock(&insert_lock);
+            return 0;
+        }
+        mem_charge(MEM_INTERN, (long)(sizeof(*e) + len + 1));
+        e->hash = h;
+        e->id = id;
+        e->len = (uint32_t)len;
+        memcpy(e->s, s, len);
+        e->s[len] = '\0';
+        atomic_store_explicit(&by_id[id], e, memory_order_release);
+        atomic_store_explicit(&slots[slot], e, memory_order_release);
+        atomic_store(&next_id, id + 1);
+    }
+    pthread_mutex_unlock(&insert_lock);
+    return e->id;
+}
+
+uint32_t intern(const char *s, size_t len) {
+    return intern_upto(s, len, max_ids);
+}
+
+uint32_t intern_limited(const char *s, size_t len) {
+    return intern_upto(s, len, max_ids / 2);
+}
+
+const char *intern_str(uint32_t id) {
+    if (id == 0 || id > max_ids) return "";
+    intern_entry_t *e = atomic_load_explicit(&by_id[id], memory_order_acquire);
+    return e ? e->s : "";
+}
+
+size_t intern_len(uint32_t id) {
+    if (id == 0 || id > max_ids) return 0;
+    intern_entry_t *e = atomic_load_explicit(&by_id[id], memory_order_acquire);
+    return e ? e->len : 0;
+}
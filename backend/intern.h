@@ -0,0 +1,30 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* String interning for room names, user names and other repeated metadata.
+ * Each distinct string gets a small, stable, non-zero id for the life of the
+ * process; id 0 means "none". Lookups are lock-free; only inserting a new
+ * string takes a lock. */
+int intern_init(size_t max_strings);
+
+/* Id for s (interning it if new), or 0 if the table is full. */
+uint32_t intern(const char *s, size_t len);
+
+/* Id for s if already interned, else 0. Never allocates. Read paths use
+ * this: a name nobody has written to has no history. */
+uint32_t intern_find(const char *s, size_t len);
+
+/* Like intern(), but a new string only gets an id while the table is less
+ * than half full. For names that clients may merely ask about (a
+ * subscription to a room not written yet): ids are never freed, so such
+ * probes must not be able to use up the ids that writes need. */
+uint32_t intern_limited(const char *s, size_t len);
+
+/* The string for an id; "" for 0 or an unknown id. */
+const char *intern_str(uint32_t id);
+size_t intern_len(uint32_t id);
+
+#endif
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "mem.h"
+
+#define HUGE_PAGE_SIZE (2u << 20)
+
+enum { HP_OFF, HP_THP, HP_HUGETLB };
+
+static const char *subsys_names[MEM_SUBSYS_COUNT] = { "cache", "rooms", "intern", "subscriber", "webhook", "idem" };
+static atomic_long used[MEM_SUBSYS_COUNT];
+static atomic_long huge_bytes[MEM_SUBSYS_COUNT];     /* mapped with MAP_HUGETLB */
+static atomic_ulong shed[MEM_SUBSYS_COUNT];          /* refused charges */
+static int hp_mode = HP_THP;
+
+static size_t limit = 0;
+static size_t quota[MEM_SUBSYS_COUNT];
+static mem_reclaim_fn reclaimers[MEM_SUBSYS_COUNT];
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* "512M", "2G", "64k" or plain bytes; 0 if malformed. */
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return end == s || *end ? 0 : (size_t)v;
+}
+
+static int parse_quotas(const char *list) {
+    char *copy = strdup(list);
+    if (!copy) return -1;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int sub = -1;
+        if (eq) {
+            *eq = '\0';
+            for (int i = 0; i < MEM_SUBSYS_COUNT; i++)
+                if (strcmp(subsys_names[i], item) == 0) sub = i;
+        }
+        size_t bytes = eq ? parse_size(eq + 1) : 0;
+        if (sub < 0 || bytes == 0) {
+            fprintf(stderr, "[MEM] bad CHAT_MEM_QUOTAS entry: %s\n", item);
+            free(copy);
+            return -1;
+        }
+        quota[sub] = bytes;
+    }
+    free(copy);
+    return 0;
+}
+
+int mem_init(void) {
+    const char *env = getenv("CHAT_HUGEPAGES");
+    if (!env || !*env || strcmp(env, "thp") == 0) hp_mode = HP_THP;
+    else if (strcmp(env, "off") == 0) hp_mode = HP_OFF;
+    else if (strcmp(env, "hugetlb") == 0) hp_mode = HP_HUGETLB;
+    else { fprintf(stderr, "[MEM] CHAT_HUGEPAGES must be off, thp or hugetlb\n"); return -1; }
+
+    env = getenv("CHAT_MEM_LIMIT");
+    if (env && *env && !(limit = parse_size(env))) {
+        fprintf(stderr, "[MEM] bad CHAT_MEM_LIMIT: %s\n", env);
+        return -1;
+    }
+    env = getenv("CHAT_MEM_QUOTAS");
+    if (env && *env && parse_quotas(env) != 0) return -1;
+    return 0;
+}
+
+void mem_charge(mem_subsys_t sub, long delta) {
+    atomic_fetch_add_explicit(&used[sub], delta, memory_order_relaxed);
+}
+
+size_t mem_used(mem_subsys_t sub) {
+    long v = atomic_load_explicit(&used[sub], memory_order_relaxed);
+    return v > 0 ? (size_t)v : 0;
+}
+
+static size_t total_used(void) {
+    size_t total = 0;
+    for (int i = 0; i < MEM_SUBSYS_COUNT; i++) total += mem_used((mem_subsys_t)i);
+    return total;
+}
+
+static int over_quota(mem_subsys_t sub, size_t bytes, size_t *excess) {
+    size_t u = mem_used(sub) + bytes;
+    *excess = quota[sub] && u > quota[sub] ? u - quota[sub] : 0;
+    return *excess != 0;
+}
+
+static int over_limit(size_t bytes, size_t *excess) {
+    size_t u = total_used() + bytes;
+    *excess = limit && u > limit ? u - limit : 0;
+    return *excess != 0;
+}
+
+void mem_set_reclaim(mem_subsys_t sub, mem_reclaim_fn fn) {
+    reclaimers[sub] = fn;
+}
+
+/* Reclaimers take their subsystem's own locks, so callers must not hold
+ * them here; reclaim_lock keeps one thread evicting at a time. */
+int mem_try_charge(mem_subsys_t sub, size_t bytes) {
+    size_t excess;
+    if (!over_quota(sub, bytes, &excess) && !over_limit(bytes, &excess)) {
+        mem_charge(sub, (long)bytes);
+        return 0;
+    }
+
+    pthread_mutex_lock(&reclaim_lock);
+    if (over_quota(sub, bytes, &excess) && reclaimers[sub]) reclaimers[sub](excess);
+    for (int i = 0; i < MEM_SUBSYS_COUNT && over_limit(bytes, &excess); i++)
+        if (reclaimers[i]) reclaimers[i](excess);
+    int ok = !over_quota(sub, bytes, &excess) && !over_limit(bytes, &excess);
+    if (ok) mem_charge(sub, (long)bytes);
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (!ok) atomic_fetch_add_explicit(&shed[sub], 1, memory_order_relaxed);
+    return ok ? 0 : -1;
+}
+
+/* Map len bytes (a multiple of HUGE_PAGE_SIZE) aligned to a huge page, so
+ * THP can back the whole range instead of only its aligned middle. */
+static void *map_aligned(size_t len) {
+    size_t span = len + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    uintptr_t start = ((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    size_t head = start - (uintptr_t)raw;
+    if (head) munmap(raw, head);
+    if (span - head > len) munmap((char *)start + len, span - head - len);
+    return (void *)start;
+}
+
+/* Size actually mapped for a request of bytes. */
+static size_t large_size(size_t bytes) {
+    if (bytes < MEM_LARGE_MIN || hp_mode == HP_OFF) return bytes;
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+void *mem_reserve_large(mem_subsys_t sub, size_t bytes) {
+    if (bytes < MEM_LARGE_MIN || hp_mode == HP_OFF) return calloc(1, bytes);
+    size_t len = large_size(bytes);
+    if (hp_mode == HP_HUGETLB) {
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            atomic_fetch_add(&huge_bytes[sub], (long)len);
+            return p;
+        }
+        fprintf(stderr, "[MEM] MAP_HUGETLB failed for %zu bytes (%s), using THP\n", len, subsys_names[sub]);
+    }
+    void *p = map_aligned(len);
+    if (!p) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void *mem_alloc_large(mem_subsys_t sub, size_t bytes) {
+    void *p = mem_reserve_large(sub, bytes);
+    if (p) mem_charge(sub, (long)large_size(bytes));
+    return p;
+}
+
+/* Release whole pages only: huge pages when huge pages are in use, so a
+ * partial release doesn't split them. */
+void mem_release(void *p, size_t len) {
+    uintptr_t page = hp_mode == HP_OFF ? (uintptr_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)p + len) & ~(page - 1);
+    if (end > start) madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/* AnonHugePages from /proc/self/smaps_rollup, in kB, or -1. */
+static long thp_kb(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+void mem_report(FILE *out) {
+    static const char *mode_names[] = { "off", "thp", "hugetlb" };
+    size_t total = 0;
+    fprintf(out, "[MEM] huge pages: %s", mode_names[hp_mode]);
+    if (limit) fprintf(out, ", limit %zu KB", limit >> 10);
+    fputc('\n', out);
+    for (int i = 0; i < MEM_SUBSYS_COUNT; i++) {
+        size_t u = mem_used((mem_subsys_t)i);
+        long h = atomic_load(&huge_bytes[i]);
+        unsigned long s = atomic_load(&shed[i]);
+        total += u;
+        fprintf(out, "[MEM]   %-10s %10zu KB", subsys_names[i], u >> 10);
+        if (quota[i]) fprintf(out, " / %zu KB quota", quota[i] >> 10);
+        if (h) fprintf(out, " (%ld KB hugetlb mapped)", h >> 10);
+        if (s) fprintf(out, ", %lu shed", s);
+        fputc('\n', out);
+    }
+    fprintf(out, "[MEM]   %-10s %10zu KB", "total", total >> 10);
+    long kb = thp_kb();
+    if (kb >= 0) fprintf(out, ", %ld KB in transparent huge pages", kb);
+    fputc('\n', out);
+}
@@ -0,0 +1,62 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Memory accounting and budget per subsystem, and large allocations that can
+ * be backed by huge pages.
+ *
+ *   CHAT_HUGEPAGES   off | thp | hugetlb (default thp)
+ *   CHAT_MEM_LIMIT   global budget, e.g. "2G" (default: none)
+ *   CHAT_MEM_QUOTAS  per-subsystem caps, e.g. "subscriber=64M,webhook=32M"
+ *
+ * thp maps large allocations on 2 MB boundaries and advises the kernel to
+ * back them with transparent huge pages; hugetlb asks for MAP_HUGETLB pages
+ * from the reserved pool and falls back to thp when none are available.
+ *
+ * Growth that can be refused goes through mem_try_charge. When it would
+ * exceed the subsystem's quota the subsystem's own reclaimer runs; when it
+ * would exceed the global limit the reclaimers run in enum order (caches
+ * first, then queues) until it fits. If it still doesn't, the charge fails
+ * and the caller sheds the data. The budget is soft: concurrent charges can
+ * overshoot it by a few messages. */
+typedef enum {
+    MEM_CACHE,          /* history columns and live text */
+    MEM_ROOMS,          /* hot rooms' recent messages */
+    MEM_INTERN,         /* interned names */
+    MEM_SUBSCRIBER,     /* queued subscriber lines */
+    MEM_WEBHOOK,        /* queued webhook events */
+    MEM_IDEM,           /* idempotency keys */
+    MEM_SUBSYS_COUNT
+} mem_subsys_t;
+
+int mem_init(void);
+
+/* Zeroed memory of at least bytes. Allocations of MEM_LARGE_MIN and up are
+ * mapped directly (huge pages if enabled); smaller ones come from calloc.
+ * Large allocations live for the whole process. mem_alloc_large charges the
+ * whole size to sub; mem_reserve_large charges nothing, for arenas that
+ * account for what they hold as they fill. */
+#define MEM_LARGE_MIN (2u << 20)
+void *mem_alloc_large(mem_subsys_t sub, size_t bytes);
+void *mem_reserve_large(mem_subsys_t sub, size_t bytes);
+
+/* Give the pages fully inside [p, p + len) of a reserved region back to the
+ * kernel; they read as zero when next touched. */
+void mem_release(void *p, size_t len);
+
+/* Account heap memory a subsystem allocated itself (negative to release). */
+void mem_charge(mem_subsys_t sub, long delta);
+size_t mem_used(mem_subsys_t sub);
+
+/* Charge bytes to sub if the budget allows, reclaiming first if needed.
+ * Returns 0 if charged, -1 if the caller should shed. */
+typedef size_t (*mem_reclaim_fn)(size_t want);
+void mem_set_reclaim(mem_subsys_t sub, mem_reclaim_fn fn);
+int mem_try_charge(mem_subsys_t sub, size_t bytes);
+
+/* One line per subsystem plus the process's huge page usage. */
+void mem_report(FILE *out);
+
+#endif
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "mux.h"
+#include "net.h"
+
+#define MUX_BUCKETS 256
+#define MUX_CHUNK 16384
+
+static size_t window = 65536;
+static int max_streams = 256;
+
+typedef struct mux_conn mux_conn_t;
+
+/* One logical session. The connection's reader queues DATA into `in`; the
+ * connection's pump moves it into the session's socket and forwards
+ * whatever the session writes back as DATA while credit lasts. Guarded by
+ * the connection's lock; only the pump unlinks a stream. */
+typedef struct mux_stream {
+    uint32_t id;
+    int fd;                 /* our end of the session's socketpair */
+    char *in;
+    size_t in_len, in_cap;
+    size_t unacked;         /* DATA received and not yet granted back */
+    size_t credit;          /* DATA we may still send */
+    int peer_closed;
+    int shut;               /* the peer's EOF has been passed on */
+    int done;               /* the session is gone */
+    struct mux_stream *next;
+} mux_stream_t;
+
+struct mux_conn {
+    int sock;
+    int wake;               /* eventfd: the pump has new work */
+    pthread_mutex_t send_lock;
+    pthread_mutex_t lock;   /* table, live, dead and the streams' state */
+    mux_stream_t *table[MUX_BUCKETS];
+    int live;
+    int dead;               /* the reader is done; the pump stops */
+};
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24); p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);  p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int send_frame(mux_conn_t *c, uint32_t id, int type, const void *payload, size_t len) {
+    unsigned char hdr[MUX_HEADER_LEN];
+    put32(hdr, id);
+    hdr[4] = (unsigned char)type;
+    put32(hdr + 5, (uint32_t)len);
+    struct iovec iov[2] = { { hdr, sizeof(hdr) }, { (void *)payload, len } };
+    pthread_mutex_lock(&c->send_lock);
+    int rc = net_sendv(c->sock, iov, len ? 2 : 1);
+    pthread_mutex_unlock(&c->send_lock);
+    /* A dead socket ends the reader's recv too, which tears everything down. */
+    if (rc != 0) shutdown(c->sock, SHUT_RDWR);
+    return rc;
+}
+
+static int send_window(mux_conn_t *c, uint32_t id, size_t n) {
+    unsigned char grant[4];
+    put32(grant, (uint32_t)n);
+    return send_frame(c, id, MUX_WINDOW, grant, sizeof(grant));
+}
+
+static void wake(mux_conn_t *c) {
+    uint64_t one = 1;
+    ssize_t rc = write(c->wake, &one, sizeof(one));
+    (void)rc;
+}
+
+/* Caller holds c->lock. */
+static mux_stream_t *find_stream(mux_conn_t *c, uint32_t id) {
+    for (mux_stream_t *s = c->table[id % MUX_BUCKETS]; s; s = s->next)
+        if (s->id == id) return s;
+    return NULL;
+}
+
+/* Caller holds c->lock. */
+static void unlink_stream(mux_conn_t *c, mux_stream_t *s) {
+    for (mux_stream_t **pp = &c->table[s->id % MUX_BUCKETS]; *pp; pp = &(*pp)->next) {
+        if (*pp == s) { *pp = s->next; break; }
+    }
+    c->live--;
+}
+
+static void stream_free(mux_stream_t *s) {
+    close(s->fd);
+    free(s->in);
+    free(s);
+}
+
+/* Feed the session what the peer sent and grant the peer that much back. */
+static void pump_in(mux_conn_t *c, mux_stream_t *s) {
+    pthread_mutex_lock(&c->lock);
+    ssize_t n = send(s->fd, s->in, s->in_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+        memmove(s->in, s->in + n, s->in_len - (size_t)n);
+        s->in_len -= (size_t)n;
+        s->unacked -= (size_t)n;
+    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        s->in_len = 0;
+        s->done = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (n > 0) send_window(c, s->id, (size_t)n);
+}
+
+/* Forward what the session wrote, up to the credit the peer granted. */
+static void pump_out(mux_conn_t *c, mux_stream_t *s, char *buf, size_t size) {
+    pthread_mutex_lock(&c->lock);
+    size_t want = s->credit < size ? s->credit : size;
+    pthread_mutex_unlock(&c->lock);
+    ssize_t n = recv(s->fd, buf, want, MSG_DONTWAIT);
+    if (n > 0) {
+        pthread_mutex_lock(&c->lock);
+        s->credit -= (size_t)n;
+        pthread_mutex_unlock(&c->lock);
+        send_frame(c, s->id, MUX_DATA, buf, (size_t)n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        s->done = 1;
+    }
+}
+
+/* Every stream of a connection is served from this one thread: one poll
+ * over the connection's eventfd and each session's socket, rebuilt from the
+ * table after every wakeup, until the reader marks the connection dead. */
+static void *pump(void *arg) {
+    mux_conn_t *c = arg;
+    char buf[MUX_CHUNK];
+    struct pollfd *pfds = NULL;
+    mux_stream_t **streams = NULL;
+    size_t cap = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        if (c->dead) { pthread_mutex_unlock(&c->lock); break; }
+        size_t need = (size_t)c->live + 1;
+        if (need > cap) {
+            struct pollfd *p = realloc(pfds, need * sizeof(*pfds));
+            if (p) pfds = p;
+            mux_stream_t **q = p ? realloc(streams, need * sizeof(*streams)) : NULL;
+            if (q) streams = q;
+            if (!p || !q) {
+                pthread_mutex_unlock(&c->lock);
+                perror("[MUX] pump");
+                break;
+            }
+            cap = need;
+        }
+        size_t n = 1;
+        pfds[0] = (struct pollfd){ c->wake, POLLIN, 0 };
+        for (int b = 0; b < MUX_BUCKETS; b++) {
+            for (mux_stream_t *s = c->table[b]; s; s = s->next) {
+                if (s->peer_closed && !s->in_len && !s->shut) {
+                    /* Everything the peer sent is delivered: pass its EOF on. */
+                    shutdown(s->fd, SHUT_WR);
+                    s->shut = 1;
+                }
+                short events = (short)((s->credit > 0 ? POLLIN : 0) | (s->in_len > 0 ? POLLOUT : 0));
+                pfds[n] = (struct pollfd){ events ? s->fd : -1, events, 0 };
+                streams[n++] = s;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        if (poll(pfds, (nfds_t)n, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("[MUX] poll");
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            uint64_t v;
+            ssize_t rc = read(c->wake, &v, sizeof(v));
+            (void)rc;
+        }
+        for (size_t i = 1; i < n; i++) {
+            mux_stream_t *s = streams[i];
+            short ev = pfds[i].revents;
+            if ((pfds[i].events & POLLOUT) && (ev & (POLLOUT | POLLERR | POLLHUP))) pump_in(c, s);
+            if (!s->done && (pfds[i].events & POLLIN) && (ev & (POLLIN | POLLERR | POLLHUP)))
+                pump_out(c, s, buf, sizeof(buf));
+            if (s->done) {
+                send_frame(c, s->id, MUX_CLOSE, NULL, 0);
+                pthread_mutex_lock(&c->lock);
+                unlink_stream(c, s);
+                pthread_mutex_unlock(&c->lock);
+                stream_free(s);
+            }
+        }
+    }
+
+    /* Stopped early: end the connection so the reader stops too. */
+    shutdown(c->sock, SHUT_RDWR);
+    free(pfds);
+    free(streams);
+    return NULL;
+}
+
+/* Caller holds c->lock. Queues bytes for the session; -1 if the peer
+ * overran the window it was granted. */
+static int stream_queue(mux_conn_t *c, mux_stream_t *s, const char *data, size_t len) {
+    if (s->unacked + len > window) return -1;
+    if (s->in_len + len > s->in_cap) {
+        size_t cap = s->in_cap ? s->in_cap : 4096;
+        while (cap < s->in_len + len) cap *= 2;
+        char *grown = realloc(s->in, cap);
+        if (!grown) return -1;
+        s->in = grown;
+        s->in_cap = cap;
+    }
+    /* With bytes already queued the pump is watching this session. */
+    if (s->in_len == 0) wake(c);
+    memcpy(s->in + s->in_len, data, len);
+    s->in_len += len;
+    s->unacked += len;
+    return 0;
+}
+
+static int open_stream(mux_conn_t *c, uint32_t id, const char *payload, size_t len, mux_spawn_fn spawn, void *ctx) {
+    pthread_mutex_lock(&c->lock);
+    if (find_stream(c, id)) { pthread_mutex_unlock(&c->lock); return -1; }
+    int full = c->live >= max_streams;
+    pthread_mutex_unlock(&c->lock);
+    if (full || len > window) return send_frame(c, id, MUX_CLOSE, NULL, 0) == 0 ? 0 : -1;
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) return send_frame(c, id, MUX_CLOSE, NULL, 0);
+    mux_stream_t *s = calloc(1, sizeof(*s));
+    if (!s) {
+        close(pair[0]); close(pair[1]);
+        return send_frame(c, id, MUX_CLOSE, NULL, 0);
+    }
+    s->id = id;
+    s->fd = pair[0];
+    s->credit = window;
+
+    if (spawn(pair[1], ctx) != 0) {
+        close(pair[1]);
+        stream_free(s);
+        return send_frame(c, id, MUX_CLOSE, NULL, 0);
+    }
+    pthread_mutex_lock(&c->lock);
+    if (len && stream_queue(c, s, payload, len) != 0) s->done = 1;
+    s->next = c->table[id % MUX_BUCKETS];
+    c->table[id % MUX_BUCKETS] = s;
+    c->live++;
+    wake(c);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Reads from the bytes left over after the role line first, then the socket. */
+typedef struct {
+    int sock;
+    const char *pending;
+    size_t pending_len;
+} mux_reader_t;
+
+static int read_exact(mux_reader_t *r, void *out, size_t len) {
+    char *p = out;
+    size_t take = r->pending_len < len ? r->pending_len : len;
+    memcpy(p, r->pending, take);
+    r->pending += take;
+    r->pending_len -= take;
+    for (size_t got = take; got < len; ) {
+        ssize_t n = recv(r->sock, p + got, len - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/* One frame from the peer; -1 ends the connection. */
+static int handle_frame(mux_conn_t *c, uint32_t id, int type, const char *payload, size_t len, mux_spawn_fn spawn, void *ctx) {
+    if (type == MUX_OPEN) return open_stream(c, id, payload, len, spawn, ctx);
+
+    int rc = 0;
+    pthread_mutex_lock(&c->lock);
+    mux_stream_t *s = find_stream(c, id);
+    /* Frames for a stream we already closed are expected in flight. */
+    if (s) {
+        switch (type) {
+        case MUX_DATA:
+            rc = stream_queue(c, s, payload, len);
+            break;
+        case MUX_CLOSE:
+            s->peer_closed = 1;
+            wake(c);
+            break;
+        case MUX_WINDOW:
+            if (len != 4) { rc = -1; break; }
+            /* With credit left the pump is already watching this session. */
+            if (s->credit == 0) wake(c);
+            s->credit += get32((const unsigned char *)payload);
+            break;
+        default:
+            rc = -1;
+        }
+    } else if (type < MUX_OPEN || type > MUX_WINDOW) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+int mux_init(void) {
+    const char *env = getenv("CHAT_MUX_WINDOW");
+    if (env && atol(env) > 0) window = (size_t)atol(env);
+    env = getenv("CHAT_MUX_STREAMS");
+    if (env && atoi(env) > 0) max_streams = atoi(env);
+    return 0;
+}
+
+void mux_serve(int sock, const char *pending, size_t pending_len, mux_spawn_fn spawn, void *ctx) {
+    mux_conn_t *c = calloc(1, sizeof(*c));
+    if (!c) { close(sock); return; }
+    c->sock = sock;
+    pthread_mutex_init(&c->send_lock, NULL);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_t pump_tid;
+    c->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->wake < 0 || pthread_create(&pump_tid, NULL, pump, c) != 0) {
+        perror("[MUX] pump");
+        if (c->wake >= 0) close(c->wake);
+        pthread_mutex_destroy(&c->lock);
+        pthread_mutex_destroy(&c->send_lock);
+        free(c);
+        close(sock);
+        return;
+    }
+
+    printf("[MUX] Connection opened (sock=%d)\n", sock);
+    send(sock, "OK: mux\n", 8, MSG_NOSIGNAL);
+
+    mux_reader_t r = { sock, pending, pending_len };
+    char *payload = malloc(MUX_FRAME_MAX);
+    unsigned char hdr[MUX_HEADER_LEN];
+    unsigned long frames = 0;
+    while (payload && read_exact(&r, hdr, sizeof(hdr)) == 0) {
+        uint32_t id = get32(hdr);
+        uint32_t len = get32(hdr + 5);
+        if (len > MUX_FRAME_MAX || read_exact(&r, payload, len) != 0) break;
+        if (handle_frame(c, id, hdr[4], payload, len, spawn, ctx) != 0) {
+            fprintf(stderr, "[MUX] protocol error on stream %u (sock=%d)\n", id, sock);
+            break;
+        }
+        frames++;
+    }
+
+    /* Tear down: unblock the pump if it is stuck sending, stop it, then
+     * close every session's socket so the sessions end. */
+    free(payload);
+    shutdown(sock, SHUT_RDWR);
+    pthread_mutex_lock(&c->lock);
+    c->dead = 1;
+    pthread_mutex_unlock(&c->lock);
+    wake(c);
+    pthread_join(pump_tid, NULL);
+    for (int b = 0; b < MUX_BUCKETS; b++) {
+        for (mux_stream_t *s = c->table[b], *next; s; s = next) {
+            next = s->next;
+            stream_free(s);
+        }
+    }
+
+    printf("[MUX] Connection closed after %lu frames (sock=%d)\n", frames, sock);
+    close(sock);
+    close(c->wake);
+    pthread_mutex_destroy(&c->lock);
+    pthread_mutex_destroy(&c->send_lock);
+    free(c);
+}
@@ -0,0 +1,43 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stream multiplexing: after the role line "mux\n" (answered with
+ * "OK: mux\n") both sides exchange frames
+ *
+ *   [u32 stream][u8 type][u32 len][len bytes]     (big-endian)
+ *
+ * OPEN starts stream <stream> as an independent session speaking the plain
+ * protocol (its payload, if any, is the session's first bytes); DATA carries
+ * session bytes either way; CLOSE ends the stream from either side; WINDOW
+ * grants the peer <u32 payload> more bytes of DATA on that stream.
+ *
+ * Each side may send at most CHAT_MUX_WINDOW bytes (default 65536) of DATA
+ * per stream beyond what the other side has granted back, so one slow
+ * session never stalls the others.
+ *
+ * A connection costs two threads: one reads frames, one polls every
+ * stream's socket at once. Each stream is still a session like any other,
+ * with its own thread and a socketpair, so CHAT_MUX_STREAMS caps the
+ * concurrent streams per connection (default 256); an OPEN beyond it is
+ * answered with CLOSE. */
+#define MUX_OPEN 1
+#define MUX_DATA 2
+#define MUX_CLOSE 3
+#define MUX_WINDOW 4
+
+#define MUX_HEADER_LEN 9
+#define MUX_FRAME_MAX 65536
+
+/* Start a session on fd (one end of a socketpair); returns 0 or -1. */
+typedef int (*mux_spawn_fn)(int fd, void *ctx);
+
+int mux_init(void);
+
+/* Serve a mux connection until the peer goes away. pending holds bytes
+ * already read past the role line. Closes sock. */
+void mux_serve(int sock, const char *pending, size_t pending_len, mux_spawn_fn spawn, void *ctx);
+
+#endif
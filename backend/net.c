@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "net.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+const net_profile_t net_default_profile = { .name = "default" };
+static net_profile_t lowlatency_profile = { .name = "lowlatency", .nodelay = 1, .quickack = 1, .busy_poll_us = 50 };
+static atomic_uint next_cpu;
+static int defer_accept_sec = 5;
+static int fastopen_qlen = 256;
+static int first_read_ms = 5000;
+
+static void load_accept_options(void) {
+    const char *env;
+    if ((env = getenv("CHAT_DEFER_ACCEPT_SEC")) && atoi(env) >= 0) defer_accept_sec = atoi(env);
+    if ((env = getenv("CHAT_FASTOPEN_QLEN")) && atoi(env) >= 0) fastopen_qlen = atoi(env);
+    if ((env = getenv("CHAT_FIRST_READ_MS")) && atoi(env) > 0) first_read_ms = atoi(env);
+}
+
+static void load_lowlatency(void) {
+    net_profile_t *p = &lowlatency_profile;
+    const char *env;
+    if ((env = getenv("CHAT_LL_BUSY_POLL_US")) && atoi(env) >= 0) p->busy_poll_us = atoi(env);
+    if ((env = getenv("CHAT_LL_RCVBUF")) && atoi(env) > 0) p->rcvbuf = atoi(env);
+    if ((env = getenv("CHAT_LL_SNDBUF")) && atoi(env) > 0) p->sndbuf = atoi(env);
+    if ((env = getenv("CHAT_LL_SPIN_US")) && atol(env) > 0) p->spin_us = atol(env);
+    if ((env = getenv("CHAT_LL_CPUS")) && *env) {
+        char *copy = strdup(env), *save = NULL;
+        for (char *c = copy ? strtok_r(copy, ",", &save) : NULL; c && p->ncpus < NET_MAX_CPUS; c = strtok_r(NULL, ",", &save))
+            p->cpus[p->ncpus++] = atoi(c);
+        free(copy);
+    }
+}
+
+static void set_opt(int fd, int level, int opt, int value, const char *what) {
+    if (setsockopt(fd, level, opt, &value, sizeof(value)) < 0)
+        fprintf(stderr, "[NET] %s=%d: %s\n", what, value, strerror(errno));
+}
+
+/* Options set on the listener are inherited by accepted sockets; buffer
+ * sizes in particular must be set before listen() to affect window scaling. */
+static void tune_listener(int fd, const net_profile_t *p) {
+    if (p->nodelay) set_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (p->busy_poll_us) set_opt(fd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll_us, "SO_BUSY_POLL");
+    if (p->rcvbuf) set_opt(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF");
+    if (p->sndbuf) set_opt(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF");
+}
+
+static int open_listener(int port, const net_profile_t *p, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    tune_listener(fd, p);
+    /* Every client speaks first, so nothing needs a thread until its role
+     * line has arrived; a peer that never sends is dropped in the kernel. */
+    if (defer_accept_sec) set_opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept_sec, "TCP_DEFER_ACCEPT");
+    if (fastopen_qlen) set_opt(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen_qlen, "TCP_FASTOPEN");
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET; addr.sin_port = htons((uint16_t)port); addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); close(fd); return -1; }
+    if (listen(fd, backlog) < 0) { perror("listen"); close(fd); return -1; }
+    return fd;
+}
+
+int net_listen_all(net_listener_t *out, int max, int default_port, int backlog) {
+    load_accept_options();
+    load_lowlatency();
+    const char *env = getenv("CHAT_LISTEN");
+    char fallback[16];
+    snprintf(fallback, sizeof(fallback), "%d", default_port);
+    char *copy = strdup(env && *env ? env : fallback);
+    if (!copy) return -1;
+    int n = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(item, ':');
+        const net_profile_t *p = &net_default_profile;
+        if (colon) {
+            *colon = '\0';
+            if (strcmp(colon + 1, "lowlatency") == 0) p = &lowlatency_profile;
+            else if (strcmp(colon + 1, "default") != 0) { fprintf(stderr, "[NET] unknown listener profile: %s\n", colon + 1); n = -1; break; }
+        }
+        int port = atoi(item);
+        if (port <= 0 || port > 65535 || n == max) { fprintf(stderr, "[NET] bad CHAT_LISTEN entry: %s\n", item); n = -1; break; }
+        int fd = open_listener(port, p, backlog);
+        if (fd < 0) { n = -1; break; }
+        out[n].fd = fd;
+        out[n].port = port;
+        out[n].profile = p;
+        n++;
+    }
+    free(copy);
+    if (n < 0) return -1;
+    return n;
+}
+
+void net_setup_conn(int fd, const net_profile_t *p) {
+    if (p->nodelay) set_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (p->quickack) set_opt(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    if (p->ncpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(p->cpus[atomic_fetch_add(&next_cpu, 1) % (unsigned)p->ncpus], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ssize_t net_recv(int fd, void *buf, size_t len, const net_profile_t *p) {
+    ssize_t n = -1;
+    if (p->spin_us) {
+        int64_t deadline = now_ns() + p->spin_us * 1000;
+        do {
+            n = recv(fd, buf, len, MSG_DONTWAIT);
+        } while (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && now_ns() < deadline);
+    }
+    if (n < 0) n = recv(fd, buf, len, 0);
+    if (p->quickack && n > 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+    return n;
+}
+
+ssize_t net_recv_first(int fd, void *buf, size_t len) {
+    ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, first_read_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) { errno = ETIMEDOUT; return -1; }
+    return recv(fd, buf, len, 0);
+}
+
+int net_sendv(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        int chunk = n < IOV_MAX ? n : IOV_MAX;
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = (size_t)chunk;
+        ssize_t sent = sendmsg(fd, &mh, MSG_NOSIGNAL | (chunk < n ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        /* Skip what went out; a partial entry is trimmed and resent. */
+        while (n > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0 && sent > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define NET_MAX_LISTENERS 8
+#define NET_MAX_CPUS 64
+
+/* Per-listener socket profile. CHAT_LISTEN lists the listeners as
+ * "port[:profile],..." (default "8080"); profile is "default" or
+ * "lowlatency". The low-latency profile is tuned by:
+ *
+ *   CHAT_LL_BUSY_POLL_US   SO_BUSY_POLL budget (default 50)
+ *   CHAT_LL_RCVBUF         SO_RCVBUF bytes (default: kernel autotuning)
+ *   CHAT_LL_SNDBUF         SO_SNDBUF bytes (default: kernel autotuning)
+ *   CHAT_LL_SPIN_US        spin on a non-blocking recv this long before
+ *                          sleeping in the kernel (default 0: never spin)
+ *   CHAT_LL_CPUS           pin connection threads round-robin to these
+ *                          cores, e.g. "2,3" (default: no pinning)
+ *
+ * and always sets TCP_NODELAY and re-arms TCP_QUICKACK after every read.
+ *
+ * All listeners use TCP_DEFER_ACCEPT (CHAT_DEFER_ACCEPT_SEC, default 5, 0 to
+ * disable), so accept() only returns once the client's first bytes are in,
+ * and TCP_FASTOPEN (CHAT_FASTOPEN_QLEN pending cookies, default 256, 0 to
+ * disable), so a returning client's role line can ride in the SYN. */
+typedef struct net_profile {
+    const char *name;
+    int nodelay;
+    int quickack;
+    int busy_poll_us;
+    int rcvbuf, sndbuf;
+    long spin_us;
+    int cpus[NET_MAX_CPUS];
+    int ncpus;
+} net_profile_t;
+
+extern const net_profile_t net_default_profile;
+
+typedef struct net_listener {
+    int fd;
+    int port;
+    const net_profile_t *profile;
+} net_listener_t;
+
+/* Parse CHAT_LISTEN and open the listeners. Returns how many, or -1. */
+int net_listen_all(net_listener_t *out, int max, int default_port, int backlog);
+
+/* Per-connection setup on the connection's own thread: socket options that
+ * don't inherit from the listener, and CPU pinning. */
+void net_setup_conn(int fd, const net_profile_t *p);
+
+/* recv() under the profile: optional spin before blocking, and TCP_QUICKACK
+ * re-armed afterwards (the kernel clears it as it goes). */
+ssize_t net_recv(int fd, void *buf, size_t len, const net_profile_t *p);
+
+/* The connection's first read, normally satisfied without blocking thanks
+ * to TCP_DEFER_ACCEPT. A peer that still hasn't spoken after
+ * CHAT_FIRST_READ_MS (default 5000) fails with ETIMEDOUT. */
+ssize_t net_recv_first(int fd, void *buf, size_t len);
+
+/* Send every byte of iov[0..n) with as few syscalls as the kernel allows:
+ * one sendmsg per IOV_MAX entries, with MSG_MORE on all but the last so the
+ * pieces still leave as full segments. Retries partial sends and EINTR and
+ * never raises SIGPIPE. Modifies iov. Returns 0, or -1 if the peer is gone. */
+int net_sendv(int fd, struct iovec *iov, int n);
+
+#endif
@@ -0,0 +1,337 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "mem.h"
+#include "rooms.h"
+
+#define DEFAULT_ROOM_SLOTS 256
+#define DEFAULT_ROOM_RING 200
+
+typedef struct room_msg {
+    int64_t ts_ms;
+    uint32_t author;
+    uint32_t len;
+    unsigned char id[CHAT_ID_LEN];
+    char *text;
+} room_msg_t;
+
+enum { SLOT_FREE, SLOT_LOADING, SLOT_HOT };
+
+typedef struct room_slot {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    uint32_t room;
+    int state;
+    int referenced;          /* CLOCK bit */
+    int pins;
+    room_msg_t *ring;
+    size_t head, count;      /* oldest at head */
+    size_t bytes;
+} room_slot_t;
+
+static room_slot_t *slots;
+static size_t nslots, ring_max;
+static _Atomic int32_t *slot_of;      /* room id -> slot + 1, 0 if cold */
+static size_t max_room;
+static uint32_t default_room;
+static room_loader_fn loader;
+static size_t hand = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ulong hits, misses, evictions, load_failures;
+static atomic_ullong load_us;
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t msg_bytes(size_t len) { return sizeof(room_msg_t) + len; }
+
+/* Caller holds the slot lock. */
+static void ring_push(room_slot_t *s, const chat_msg_t *msg) {
+    room_msg_t *m;
+    if (s->count == ring_max) {
+        m = &s->ring[s->head];
+        s->head = (s->head + 1) % ring_max;
+        s->count--;
+        s->bytes -= msg_bytes(m->len);
+        mem_charge(MEM_ROOMS, -(long)msg_bytes(m->len));
+        free(m->text);
+    }
+    m = &s->ring[(s->head + s->count) % ring_max];
+    m->text = malloc(msg->len ? msg->len : 1);
+    m->len = m->text ? (uint32_t)msg->len : 0;
+    if (m->text) memcpy(m->text, msg->text, msg->len);
+    m->ts_ms = msg->ts_ms;
+    m->author = msg->author;
+    memcpy(m->id, msg->id, CHAT_ID_LEN);
+    s->count++;
+    s->bytes += msg_bytes(m->len);
+    mem_charge(MEM_ROOMS, (long)msg_bytes(m->len));
+}
+
+/* Caller holds the slot lock. */
+static void ring_clear(room_slot_t *s) {
+    for (size_t i = 0; i < s->count; i++) free(s->ring[(s->head + i) % ring_max].text);
+    mem_charge(MEM_ROOMS, -(long)s->bytes);
+    s->head = s->count = s->bytes = 0;
+}
+
+static uint32_t norm(uint32_t room) { return room ? room : default_room; }
+
+/* Commit listener: only hot (or loading) rooms follow the stream; a cold
+ * room will read its history from storage when next accessed. */
+static void rooms_on_commit(const chat_msg_t *msg, void *ctx) {
+    (void)ctx;
+    uint32_t room = norm(msg->room);
+    if (room > max_room) return;
+    int32_t idx = atomic_load(&slot_of[room]);
+    if (!idx) return;
+    room_slot_t *s = &slots[idx - 1];
+    pthread_mutex_lock(&s->lock);
+    if (s->room == room && s->state != SLOT_FREE) ring_push(s, msg);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Evict s if nothing holds it. Caller holds table_lock. Returns 1 and adds
+ * the bytes released to *freed if it was evicted. */
+static int try_evict(room_slot_t *s, size_t *freed) {
+    int evicted = 0;
+    pthread_mutex_lock(&s->lock);
+    if (s->state == SLOT_HOT && s->pins == 0) {
+        *freed += s->bytes;
+        evicted = 1;
+        ring_clear(s);
+        atomic_store(&slot_of[s->room], 0);
+        s->room = 0;
+        s->state = SLOT_FREE;
+        atomic_fetch_add(&evictions, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return evicted;
+}
+
+/* CLOCK: clear reference bits until an unreferenced, evictable room turns
+ * up (or, when take_free is set, an unused slot). Two full turns without
+ * success means everything is pinned or loading. Caller holds table_lock.
+ * Returns the slot now free, or NULL. */
+static room_slot_t *clock_evict(size_t *freed, int take_free) {
+    for (size_t step = 0; step < 2 * nslots; step++) {
+        room_slot_t *s = &slots[hand];
+        hand = (hand + 1) % nslots;
+        if (s->state == SLOT_FREE) {
+            if (take_free) return s;
+            continue;
+        }
+        if (s->referenced) { s->referenced = 0; continue; }
+        if (try_evict(s, freed)) return s;
+    }
+    return NULL;
+}
+
+static size_t rooms_reclaim(size_t want) {
+    size_t freed = 0;
+    pthread_mutex_lock(&table_lock);
+    while (freed < want && clock_evict(&freed, 0)) {}
+    pthread_mutex_unlock(&table_lock);
+    return freed;
+}
+
+int rooms_init(uint32_t def, size_t max_room_id, room_loader_fn fn) {
+    const char *env = getenv("CHAT_ROOM_SLOTS");
+    nslots = env && atol(env) > 0 ? (size_t)atol(env) : DEFAULT_ROOM_SLOTS;
+    env = getenv("CHAT_ROOM_RING");
+    ring_max = env && atol(env) > 0 ? (size_t)atol(env) : DEFAULT_ROOM_RING;
+    slots = calloc(nslots, sizeof(*slots));
+    slot_of = calloc(max_room_id + 1, sizeof(*slot_of));
+    if (!slots || !slot_of) return -1;
+    for (size_t i = 0; i < nslots; i++) {
+        pthread_mutex_init(&slots[i].lock, NULL);
+        pthread_cond_init(&slots[i].loaded, NULL);
+        slots[i].ring = calloc(ring_max, sizeof(room_msg_t));
+        if (!slots[i].ring) return -1;
+    }
+    mem_charge(MEM_ROOMS, (long)(nslots * (sizeof(room_slot_t) + ring_max * sizeof(room_msg_t))));
+    default_room = def;
+    max_room = max_room_id;
+    loader = fn;
+    mem_set_reclaim(MEM_ROOMS, rooms_reclaim);
+    return commit_subscribe(rooms_on_commit, NULL);
+}
+
+typedef struct load_buf {
+    chat_msg_t *msgs;
+    size_t n;
+    size_t bytes;
+} load_buf_t;
+
+static void load_emit(void *ctx, const chat_msg_t *msg) {
+    load_buf_t *lb = ctx;
+    if (lb->n == ring_max) return;
+    chat_msg_t *m = &lb->msgs[lb->n];
+    *m = *msg;
+    m->text = malloc(msg->len ? msg->len : 1);
+    if (!m->text) return;
+    memcpy((char *)m->text, msg->text, msg->len);
+    lb->bytes += msg_bytes(msg->len);
+    lb->n++;
+}
+
+static void load_free(load_buf_t *lb) {
+    for (size_t i = 0; i < lb->n; i++) free((char *)lb->msgs[i].text);
+    free(lb->msgs);
+}
+
+/* Fill a loading slot from storage. Messages committed meanwhile are already
+ * in the ring; stored ones go in front of them, skipping any the ring has. */
+static int load_slot(room_slot_t *s, uint32_t room) {
+    load_buf_t lb = { calloc(ring_max, sizeof(chat_msg_t)), 0, 0 };
+    int64_t t0 = now_us();
+    int rc = lb.msgs ? loader(room, ring_max, load_emit, &lb) : -1;
+    atomic_fetch_add(&load_us, (unsigned long long)(now_us() - t0));
+    /* Ask the budget for room up front (ring_push charges as it copies); a
+     * room that doesn't fit stays cold. */
+    if (rc == 0 && mem_try_charge(MEM_ROOMS, lb.bytes) != 0) rc = -1;
+    else if (rc == 0) mem_charge(MEM_ROOMS, -(long)lb.bytes);
+
+    if (rc != 0) {
+        atomic_fetch_add(&load_failures, 1);
+        pthread_mutex_lock(&table_lock);
+        pthread_mutex_lock(&s->lock);
+        ring_clear(s);
+        atomic_store(&slot_of[room], 0);
+        s->room = 0;
+        s->state = SLOT_FREE;
+        pthread_cond_broadcast(&s->loaded);
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_unlock(&table_lock);
+        load_free(&lb);
+        return -1;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    {
+        room_msg_t *live = malloc(s->count * sizeof(*live) + 1);
+        size_t nlive = 0;
+        if (live) {
+            for (; s->count; s->count--, s->head = (s->head + 1) % ring_max)
+                live[nlive++] = s->ring[s->head];
+            s->head = 0;
+        }
+        mem_charge(MEM_ROOMS, -(long)s->bytes);
+        s->bytes = 0;
+        for (size_t i = 0; i < lb.n; i++) {
+            int dup = 0;
+            for (size_t j = 0; j < nlive && !dup; j++) dup = memcmp(live[j].id, lb.msgs[i].id, CHAT_ID_LEN) == 0;
+            if (!dup) ring_push(s, &lb.msgs[i]);
+        }
+        for (size_t j = 0; j < nlive; j++) {
+            chat_msg_t m = { live[j].text, live[j].len, live[j].ts_ms, {0}, 0, room, live[j].author };
+            memcpy(m.id, live[j].id, CHAT_ID_LEN);
+            ring_push(s, &m);
+            free(live[j].text);
+        }
+        free(live);
+        s->state = SLOT_HOT;
+    }
+    pthread_cond_broadcast(&s->loaded);
+    pthread_mutex_unlock(&s->lock);
+    load_free(&lb);
+    return 0;
+}
+
+/* Return the room's slot, hot and locked, or NULL if it could not be
+ * loaded. */
+static room_slot_t *acquire(uint32_t room) {
+    for (;;) {
+        pthread_mutex_lock(&table_lock);
+        int32_t idx = atomic_load(&slot_of[room]);
+        room_slot_t *s;
+        if (idx) {
+            s = &slots[idx - 1];
+            s->referenced = 1;
+            pthread_mutex_unlock(&table_lock);
+            pthread_mutex_lock(&s->lock);
+            int waited = 0;
+            while (s->room == room && s->state == SLOT_LOADING) {
+                pthread_cond_wait(&s->loaded, &s->lock);
+                waited = 1;
+            }
+            if (s->room == room && s->state == SLOT_HOT) { atomic_fetch_add(&hits, 1); return s; }
+            pthread_mutex_unlock(&s->lock);
+            if (waited) return NULL;   /* the load we waited for failed */
+            continue;                  /* evicted under us: look again */
+        }
+
+        size_t freed = 0;
+        s = clock_evict(&freed, 1);
+        if (!s) { pthread_mutex_unlock(&table_lock); return NULL; }
+        pthread_mutex_lock(&s->lock);
+        s->room = room;
+        s->state = SLOT_LOADING;
+        s->referenced = 1;
+        pthread_mutex_unlock(&s->lock);
+        atomic_store(&slot_of[room], (int32_t)(s - slots) + 1);
+        pthread_mutex_unlock(&table_lock);
+        atomic_fetch_add(&misses, 1);
+
+        if (load_slot(s, room) != 0) return NULL;
+        pthread_mutex_lock(&s->lock);
+        if (s->room == room && s->state == SLOT_HOT) return s;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int rooms_render(uint32_t room, char *buffer, size_t buffer_size) {
+    room = norm(room);
+    buffer[0] = '\0';
+    if (room > max_room) return -1;
+    room_slot_t *s = acquire(room);
+    if (!s) return -1;
+    size_t used = 0;
+    for (size_t i = 0; i < s->count && used + 1 < buffer_size; i++) {
+        room_msg_t *m = &s->ring[(s->head + i) % ring_max];
+        used += chat_format_line(buffer + used, buffer_size - used, m->ts_ms, m->author, m->text, m->len);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+int rooms_pin(uint32_t room) {
+    room = norm(room);
+    if (room > max_room) return -1;
+    room_slot_t *s = acquire(room);
+    if (!s) return -1;
+    s->pins++;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void rooms_unpin(uint32_t room) {
+    room = norm(room);
+    if (room > max_room) return;
+    int32_t idx = atomic_load(&slot_of[room]);
+    if (!idx) return;
+    room_slot_t *s = &slots[idx - 1];
+    pthread_mutex_lock(&s->lock);
+    if (s->room == room && s->pins > 0) s->pins--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void rooms_report(FILE *out) {
+    unsigned long h = atomic_load(&hits), m = atomic_load(&misses);
+    size_t hot = 0;
+    pthread_mutex_lock(&table_lock);
+    for (size_t i = 0; i < nslots; i++) hot += slots[i].state != SLOT_FREE;
+    pthread_mutex_unlock(&table_lock);
+    fprintf(out, "[ROOMS] %zu/%zu hot, hit ratio %.1f%% (%lu hits, %lu loads, %lu failed), %lu evictions, avg load %.1f ms\n",
+            hot, nslots, h + m ? 100.0 * h / (h + m) : 0.0, h, m, atomic_load(&load_failures),
+            atomic_load(&evictions), m ? atomic_load(&load_us) / 1000.0 / m : 0.0);
+}
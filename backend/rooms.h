@@ -0,0 +1,41 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chat.h"
+
+/* Per-room hot state: the room's recent messages, loaded from storage on
+ * first access and kept current from the commit stream while the room is
+ * hot.
+ *
+ *   CHAT_ROOM_SLOTS   rooms kept hot at once (default 256)
+ *   CHAT_ROOM_RING    recent messages kept per room (default 200)
+ *
+ * When every slot is taken, or the memory budget asks for room, a CLOCK
+ * sweep evicts a room that hasn't been touched since the hand last passed.
+ * Rooms with subscribers are pinned and never evicted. */
+
+/* Fetch up to limit of the room's newest messages, calling emit for each
+ * oldest first. Returns 0, or -1 if storage could not be read. */
+typedef void (*room_emit_fn)(void *ctx, const chat_msg_t *msg);
+typedef int (*room_loader_fn)(uint32_t room, size_t limit, room_emit_fn emit, void *ctx);
+
+int rooms_init(uint32_t default_room, size_t max_room_id, room_loader_fn loader);
+
+/* Render the room's recent history as reader lines, loading it if cold.
+ * Returns 0, or -1 if the room could not be loaded. */
+int rooms_render(uint32_t room, char *buffer, size_t buffer_size);
+
+/* Keep a room hot while it has subscribers. rooms_pin returns -1 if the
+ * room could not be loaded; only a successful pin is undone by unpin. */
+int rooms_pin(uint32_t room);
+void rooms_unpin(uint32_t room);
+
+/* Hit ratio, loads and evictions (load time is what an eviction costs when
+ * the room comes back). */
+void rooms_report(FILE *out);
+
+#endif
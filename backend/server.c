@@ -12,22 +12,214 @@
  #include <time.h>
  #include <signal.h>
  #include <errno.h>
+ #include <strings.h>
+ #include <stdatomic.h>
+ #include <poll.h>
+ 
+ #include "chat.h"
+ #include "breaker.h"
+ #include "cache.h"
+ #include "doc.h"
+ #include "http.h"
+ #include "idem.h"
+ #include "intern.h"
+ #include "mem.h"
+ #include "mux.h"
+ #include "net.h"
+ #include "rooms.h"
+ #include "spool.h"
+ #include "subscriber.h"
+ #include "sync.h"
+ #include "webhook.h"
  
  #define PORT 8080
  #define MAX_CLIENTS 64
  #define BUFFER_SIZE 4096
+ #define MAX_COMMIT_LISTENERS 8
+ #define DEFAULT_CACHE_SIZE 10000
+ #define DEFAULT_CACHE_TEXT_BYTES 256   /* arena bytes per cached message */
+ #define MAX_READ_POOLS 8
+ #define MAX_ROOM_TIERS 32
+ #define DEFAULT_DB_TIMEOUT_MS 2000
+ #define DEFAULT_INTERN_MAX 65536      /* distinct room and user names */
+ #define DOC_BUFFER_SIZE (BUFFER_SIZE + 256)
+ #define MONGO_DUPLICATE_KEY 11000
  
 
- static sem_t mutex; 
- static sem_t wrt;   
- static int reader_count = 0;
+ static sem_t wrt;    /* one writer session at a time; readers don't take it */
  
 
+ /* Writes (and the sync thread) use mongo_pool against the primary. History
+  * reads are spread over read_pools, which carry their own read preference. */
  static mongoc_client_pool_t *mongo_pool = NULL;
+ static mongoc_client_pool_t *read_pools[MAX_READ_POOLS];
+ static int read_pool_count = 0;
+ static mongoc_read_prefs_t *read_prefs = NULL;
+ static atomic_uint read_rr;
+ 
+ /* Durability tiers. A room's tier (CHAT_ROOM_TIERS="room=tier,...") is the
+  * default for its messages; writers may pick another per session ("@class")
+  * or per message ("@tier text"), except that audited rooms stay audited. */
+ enum { TIER_EPHEMERAL, TIER_DEFAULT, TIER_AUDITED, TIER_COUNT };
+ static const char *tier_names[TIER_COUNT] = { "ephemeral", "default", "audited" };
+ static bson_t *tier_opts[TIER_COUNT];
+ static struct { uint32_t room; int tier; } room_tiers[MAX_ROOM_TIERS];
+ static int room_tier_count = 0;
+ 
+ /* Room and user names are interned once and passed around as ids. */
+ static uint32_t default_room;
+ 
+ typedef struct writer_state {
+     uint32_t room;
+     uint32_t author;     /* 0 until the writer sends "@user <name>" */
+     int tier;            /* -1: use the room's tier */
+ } writer_state_t;
  
  static volatile sig_atomic_t running = 1;
  void handle_sigint(int signo) { (void)signo; running = 0; fprintf(stderr, "\n[SERVER] SIGINT received\n"); }
  
+ /* Commit stream: registered at startup, before any client thread runs, so
+  * the listener table is read without locking. */
+ static struct { commit_listener_fn fn; void *ctx; } commit_listeners[MAX_COMMIT_LISTENERS];
+ static int commit_listener_count = 0;
+ 
+ int commit_subscribe(commit_listener_fn fn, void *ctx) {
+     if (commit_listener_count == MAX_COMMIT_LISTENERS) return -1;
+     commit_listeners[commit_listener_count].fn = fn;
+     commit_listeners[commit_listener_count].ctx = ctx;
+     commit_listener_count++;
+     return 0;
+ }
+ 
+ void commit_publish(const chat_msg_t *msg) {
+     for (int i = 0; i < commit_listener_count; i++)
+         commit_listeners[i].fn(msg, commit_listeners[i].ctx);
+ }
+ 
+ size_t chat_format_line_as(char *out, size_t size, int64_t ts_ms, const char *author, size_t author_len,
+                            const char *text, size_t len) {
+     char timestr[64] = {0};
+     time_t sec = ts_ms / 1000;
+     struct tm tm;
+     localtime_r(&sec, &tm);
+     strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+     int n = author ? snprintf(out, size, "[%s] %.*s: %.*s\n", timestr, (int)author_len, author, (int)len, text)
+                    : snprintf(out, size, "[%s] %.*s\n", timestr, (int)len, text);
+     if (n < 0) return 0;
+     return (size_t)n < size ? (size_t)n : size - 1;
+ }
+ 
+ size_t chat_format_line(char *out, size_t size, int64_t ts_ms, uint32_t author, const char *text, size_t len) {
+     return chat_format_line_as(out, size, ts_ms, author ? intern_str(author) : NULL, author ? intern_len(author) : 0,
+                                text, len);
+ }
+ 
+ char *chat_json_escape(char *p, const char *s, size_t len) {
+     for (size_t i = 0; i < len; i++) {
+         unsigned char c = (unsigned char)s[i];
+         if (c == '"' || c == '\\') { *p++ = '\\'; *p++ = (char)c; }
+         else if (c == '\n') { *p++ = '\\'; *p++ = 'n'; }
+         else if (c == '\r') { *p++ = '\\'; *p++ = 'r'; }
+         else if (c == '\t') { *p++ = '\\'; *p++ = 't'; }
+         else if (c < 0x20) p += sprintf(p, "\\u%04x", c);
+         else *p++ = (char)c;
+     }
+     return p;
+ }
+ 
+ size_t chat_json_max(const chat_msg_t *msg) {
+     const char *room = msg->room ? intern_str(msg->room) : CHAT_DEFAULT_ROOM;
+     return 112 + (strlen(room) + intern_len(msg->author) + msg->len) * 6;
+ }
+ 
+ size_t chat_format_json(char *out, const chat_msg_t *msg) {
+     const char *room = msg->room ? intern_str(msg->room) : CHAT_DEFAULT_ROOM;
+     size_t author_len = intern_len(msg->author);
+     char *p = out;
+     p += sprintf(p, "{\"id\":\"");
+     for (int i = 0; i < CHAT_ID_LEN; i++) p += sprintf(p, "%02x", msg->id[i]);
+     p += sprintf(p, "\",\"ts\":%lld,\"room\":\"", (long long)msg->ts_ms);
+     p = chat_json_escape(p, room, strlen(room));
+     if (author_len) {
+         p += sprintf(p, "\",\"author\":\"");
+         p = chat_json_escape(p, intern_str(msg->author), author_len);
+     }
+     p += sprintf(p, "\",\"message\":\"");
+     p = chat_json_escape(p, msg->text, msg->len);
+     *p++ = '"'; *p++ = '}'; *p = '\0';
+     return (size_t)(p - out);
+ }
+ 
+ static int parse_tier(const char *name, size_t len) {
+     for (int t = 0; t < TIER_COUNT; t++)
+         if (strlen(tier_names[t]) == len && strncmp(tier_names[t], name, len) == 0) return t;
+     return -1;
+ }
+ 
+ static int room_tier(uint32_t room) {
+     if (room == 0) room = default_room;
+     for (int i = 0; i < room_tier_count; i++)
+         if (room_tiers[i].room == room) return room_tiers[i].tier;
+     return TIER_DEFAULT;
+ }
+ 
+ static const char *room_name(uint32_t room) {
+     return room ? intern_str(room) : CHAT_DEFAULT_ROOM;
+ }
+ 
+ /* Room and user names share one alphabet and length limit. */
+ static int valid_name(const char *name) {
+     size_t n = strlen(name);
+     if (n == 0 || n > CHAT_ROOM_MAX) return 0;
+     for (size_t i = 0; i < n; i++) {
+         char c = name[i];
+         if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.')) return 0;
+     }
+     return 1;
+ }
+ 
+ /* Build the insert options for each tier once: w:0 for ephemeral, w:1 for
+  * default, majority + journal for audited. */
+ static int init_write_concerns(void) {
+     int32_t w[TIER_COUNT] = { MONGOC_WRITE_CONCERN_W_UNACKNOWLEDGED, 1, MONGOC_WRITE_CONCERN_W_MAJORITY };
+     const char *wt = getenv("CHAT_AUDIT_WTIMEOUT_MS");
+     int64_t wtimeout = wt && atol(wt) > 0 ? atol(wt) : 5000;
+     for (int t = 0; t < TIER_COUNT; t++) {
+         mongoc_write_concern_t *wc = mongoc_write_concern_new();
+         mongoc_write_concern_set_w(wc, w[t]);
+         if (t == TIER_AUDITED) {
+             mongoc_write_concern_set_journal(wc, true);
+             mongoc_write_concern_set_wtimeout_int64(wc, wtimeout);
+         }
+         tier_opts[t] = bson_new();
+         int ok = mongoc_write_concern_append(wc, tier_opts[t]);
+         mongoc_write_concern_destroy(wc);
+         if (!ok) return -1;
+     }
+ 
+     const char *list = getenv("CHAT_ROOM_TIERS");
+     if (!list || !*list) return 0;
+     char *copy = strdup(list);
+     if (!copy) return -1;
+     char *save = NULL;
+     for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+         char *eq = strchr(item, '=');
+         int tier = eq ? parse_tier(eq + 1, strlen(eq + 1)) : -1;
+         if (eq) *eq = '\0';
+         uint32_t room = tier >= 0 && valid_name(item) ? intern(item, strlen(item)) : 0;
+         if (room == 0 || room_tier_count == MAX_ROOM_TIERS) {
+             fprintf(stderr, "[SERVER] bad CHAT_ROOM_TIERS entry: %s\n", item);
+             free(copy);
+             return -1;
+         }
+         room_tiers[room_tier_count].room = room;
+         room_tiers[room_tier_count].tier = tier;
+         room_tier_count++;
+     }
+     free(copy);
+     return 0;
+ }
+ 
  /* Trim trailing newline(s) */
  static void rtrim(char *s) {
      size_t n = strlen(s);
@@ -35,175 +227,775 @@
  }
  
 
- char *insert_message_to_db_pool(const char *message) {
+ /* Per-thread document buffer. Each connection thread builds its insert
+  * documents through a bson_writer over one buffer sized for a full frame,
+  * rolling the writer back after each insert so the memory is reused: the
+  * payload is copied once, straight from the receive buffer, and the heap is
+  * only touched if a document outgrows the buffer. */
+ typedef struct doc_buffer {
+     uint8_t *buf;
+     size_t len;
+     bson_writer_t *writer;
+ } doc_buffer_t;
+ 
+ static pthread_key_t doc_buffer_key;
+ 
+ static void doc_buffer_free(void *p) {
+     doc_buffer_t *db = p;
+     bson_writer_destroy(db->writer);
+     bson_free(db->buf);
+     free(db);
+ }
+ 
+ static bson_writer_t *thread_doc_writer(void) {
+     doc_buffer_t *db = pthread_getspecific(doc_buffer_key);
+     if (db) return db->writer;
+     db = calloc(1, sizeof(*db));
+     if (!db) return NULL;
+     db->len = DOC_BUFFER_SIZE;
+     db->buf = bson_malloc(db->len);
+     db->writer = bson_writer_new(&db->buf, &db->len, 0, bson_realloc_ctx, NULL);
+     pthread_setspecific(doc_buffer_key, db);
+     return db->writer;
+ }
+ 
+ static void publish_committed(const bson_oid_t *oid, int64_t ts_ms, const char *message, size_t len, uint32_t room, uint32_t author) {
+     chat_msg_t committed = { message, len, ts_ms, {0}, 0, room, author };
+     memcpy(committed.id, oid->bytes, CHAT_ID_LEN);
+     commit_publish(&committed);
+ }
+ 
+ /* Degraded write: the breaker is open or the insert failed. The message is
+  * spooled for later replay and published now, so readers and subscribers
+  * still see it. Ephemeral messages skip the spool; audited ones are refused
+  * because a local log can't give them majority durability. */
+ static char *degraded_write(const bson_oid_t *oid, int64_t ts_ms, const char *message, size_t len, uint32_t room, uint32_t author, const char *key, int tier) {
+     if (tier == TIER_AUDITED) return strdup("ERROR: storage degraded, audited write refused\n");
+     if (tier != TIER_EPHEMERAL && spool_write(oid, ts_ms, room_name(room), intern_str(author), key, message) != 0)
+         return strdup("ERROR: storage degraded and spool unavailable\n");
+     publish_committed(oid, ts_ms, message, len, room, author);
+     return strdup("OK: message queued (storage degraded)\n");
+ }
+ 
+ /* key, if not NULL, is the message's idempotency key; a message whose key
+  * is already stored is acknowledged without being written again. */
+ char *insert_message_to_db_pool(const char *message, size_t len, uint32_t room, uint32_t author, const char *key, int tier) {
      if (!mongo_pool) {
          char *res = strdup("ERROR: no DB pool\n");
          return res;
      }
  
+     int64_t ts_ms = (int64_t)time(NULL) * 1000;
+     bson_oid_t oid;
+     bson_oid_init(&oid, NULL);
+     /* Before breaker_allow(): an admitted call must reach breaker_record(). */
+     bson_writer_t *writer = thread_doc_writer();
+     if (!writer) return strdup("ERROR: out of memory\n");
+     if (!breaker_allow()) return degraded_write(&oid, ts_ms, message, len, room, author, key, tier);
+ 
+     int64_t t0 = breaker_now_ms();
      mongoc_client_t *client = mongoc_client_pool_pop(mongo_pool);
-     if (!client) return strdup("ERROR: could not pop client\n");
+     if (!client) { breaker_record(0, breaker_now_ms() - t0); return strdup("ERROR: could not pop client\n"); }
  
      mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
      if (!coll) {
+         breaker_record(0, breaker_now_ms() - t0);
          mongoc_client_pool_push(mongo_pool, client);
          return strdup("ERROR: no collection\n");
      }
  
-     bson_t *doc = bson_new();
-     BSON_APPEND_UTF8(doc, "message", message);
-     BSON_APPEND_DATE_TIME(doc, "timestamp", (int64_t)time(NULL) * 1000);
+     bson_t *doc;
+     bson_writer_begin(writer, &doc);
+     bson_append_oid(doc, "_id", 3, &oid);
+     bson_append_utf8(doc, "message", 7, message, (int)len);
+     bson_append_date_time(doc, "timestamp", 9, ts_ms);
+     bson_append_date_time(doc, "stored", 6, ts_ms);
+     bson_append_utf8(doc, "room", 4, room_name(room), -1);
+     if (author) bson_append_utf8(doc, "author", 6, intern_str(author), (int)intern_len(author));
+     if (key) bson_append_utf8(doc, "key", 3, key, -1);
  
      bson_error_t error;
-     if (!mongoc_collection_insert_one(coll, doc, NULL, NULL, &error)) {
-         char buf[512];
-         snprintf(buf, sizeof(buf), "ERROR: insert failed: %s\n", error.message);
-         bson_destroy(doc);
-         mongoc_collection_destroy(coll);
-         mongoc_client_pool_push(mongo_pool, client);
-         return strdup(buf);
-     }
- 
-     bson_destroy(doc);
+     int ok = mongoc_collection_insert_one(coll, doc, tier_opts[tier], NULL, &error);
+     int duplicate = !ok && key && error.code == MONGO_DUPLICATE_KEY;
+     /* A rejected document says nothing about the database's health. */
+     int transient = !ok && !duplicate && spool_error_transient(&error);
+     breaker_record(!transient, breaker_now_ms() - t0);
+     bson_writer_rollback(writer);
      mongoc_collection_destroy(coll);
      mongoc_client_pool_push(mongo_pool, client);
  
-     char okmsg[256];
-     snprintf(okmsg, sizeof(okmsg), "OK: message stored\n");
-     return strdup(okmsg);
+     if (duplicate) return strdup("OK: duplicate message ignored\n");
+     if (!ok) {
+         fprintf(stderr, "[MongoDB] insert failed: %s\n", error.message);
+         if (tier == TIER_AUDITED || !transient) {
+             char buf[512];
+             snprintf(buf, sizeof(buf), "ERROR: insert failed: %s\n", error.message);
+             return strdup(buf);
+         }
+         return degraded_write(&oid, ts_ms, message, len, room, author, key, tier);
+     }
+ 
+     publish_committed(&oid, ts_ms, message, len, room, author);
+ 
+     if (tier == TIER_EPHEMERAL) return strdup("OK: message sent (unacknowledged)\n");
+     if (tier == TIER_AUDITED) return strdup("OK: message stored (majority, journaled)\n");
+     return strdup("OK: message stored\n");
  }
  
 
- void fetch_messages_from_db_pool(char *buffer, size_t buffer_size) {
-     if (!mongo_pool) {
+ /* Round-robin over the read pools, preferring one with an idle client so a
+  * saturated replica doesn't queue readers while another sits idle. */
+ static mongoc_client_t *pop_read_client(mongoc_client_pool_t **from) {
+     unsigned start = atomic_fetch_add(&read_rr, 1);
+     for (int i = 0; i < read_pool_count; i++) {
+         mongoc_client_pool_t *p = read_pools[(start + i) % read_pool_count];
+         mongoc_client_t *c = mongoc_client_pool_try_pop(p);
+         if (c) { *from = p; return c; }
+     }
+     *from = read_pools[start % read_pool_count];
+     return mongoc_client_pool_pop(*from);
+ }
+ 
+ /* A reader's view: the cache up to seq, the database up to _id upto. */
+ typedef struct history_snapshot {
+     uint64_t seq;
+     bson_oid_t upto;
+ } history_snapshot_t;
+ 
+ /* The database bound comes from the clock, not from our own writes: an
+  * ObjectId starts with its creation second, so the largest id of the
+  * current second covers everything any writer inserted up to now. */
+ static void take_snapshot(history_snapshot_t *snap) {
+     uint32_t now = (uint32_t)time(NULL);
+     memset(snap->upto.bytes, 0xff, sizeof(snap->upto.bytes));
+     snap->upto.bytes[0] = (uint8_t)(now >> 24);
+     snap->upto.bytes[1] = (uint8_t)(now >> 16);
+     snap->upto.bytes[2] = (uint8_t)(now >> 8);
+     snap->upto.bytes[3] = (uint8_t)now;
+     snap->seq = cache_seq();
+ }
+ 
+ /* Returns 0 on success, -1 if the database could not be read. With a
+  * snapshot bound, documents inserted after it are left out even if the
+  * cursor reaches them. */
+ int fetch_messages_from_db_pool(char *buffer, size_t buffer_size, const bson_oid_t *upto) {
+     if (read_pool_count == 0) {
          strncpy(buffer, "No DB pool\n", buffer_size - 1);
          buffer[buffer_size - 1] = '\0';
-         return;
+         return -1;
      }
  
-     mongoc_client_t *client = mongoc_client_pool_pop(mongo_pool);
-     if (!client) { strncpy(buffer, "DB client unavailable\n", buffer_size - 1); buffer[buffer_size-1]=0; return; }
+     mongoc_client_pool_t *pool;
+     mongoc_client_t *client = pop_read_client(&pool);
+     if (!client) { strncpy(buffer, "DB client unavailable\n", buffer_size - 1); buffer[buffer_size-1]=0; return -1; }
  
      mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
-     if (!coll) { strncpy(buffer, "DB collection unavailable\n", buffer_size - 1); buffer[buffer_size-1]=0; mongoc_client_pool_push(mongo_pool, client); return; }
+     if (!coll) { strncpy(buffer, "DB collection unavailable\n", buffer_size - 1); buffer[buffer_size-1]=0; mongoc_client_pool_push(pool, client); return -1; }
  
-     bson_t *query = bson_new();
+     bson_t *query = upto ? BCON_NEW("_id", "{", "$lte", BCON_OID(upto), "}") : bson_new();
      bson_t *opts = BCON_NEW("sort", "{", "timestamp", BCON_INT32(1), "}");
-     mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, NULL);
+     chat_doc_append_read_opts(opts);
+     mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, read_prefs);
  
      buffer[0] = '\0';
+     size_t used = 0;
      const bson_t *doc;
-     bson_iter_t iter;
+     chat_doc_t d;
      while (mongoc_cursor_next(cursor, &doc)) {
-         const char *msg = "(null)";
-         int64_t millis = 0;
-         char timestr[64] = {0};
+         if (used + 1 >= buffer_size) break;   /* reply buffer full */
+         if (chat_doc_decode(doc, &d) != 0) continue;
+         if (!d.text) { d.text = "(null)"; d.len = 6; }
+         used += chat_format_line_as(buffer + used, buffer_size - used, d.ts_ms, d.author, d.author_len, d.text, d.len);
+     }
+ 
+     bson_error_t error;
+     int rc = mongoc_cursor_error(cursor, &error) ? -1 : 0;
+     if (rc != 0) fprintf(stderr, "[MongoDB] history read failed: %s\n", error.message);
+     mongoc_cursor_destroy(cursor);
+     bson_destroy(query);
+     bson_destroy(opts);
+     mongoc_collection_destroy(coll);
+     mongoc_client_pool_push(pool, client);
+     return rc;
+ }
  
-         if (bson_iter_init_find(&iter, doc, "message") && BSON_ITER_HOLDS_UTF8(&iter))
-             msg = bson_iter_utf8(&iter, NULL);
-         if (bson_iter_init_find(&iter, doc, "timestamp") && BSON_ITER_HOLDS_DATE_TIME(&iter))
-             millis = bson_iter_date_time(&iter);
+ /* History for a reader comes from the cache when it is complete and
+  * CHAT_SYNC keeps it in step with servers sharing the collection, and
+  * otherwise from the database, falling back to the cache while the breaker
+  * is open or if the query fails. Either way the reader sees the snapshot
+  * taken on entry, so no lock is held while it reads and writers carry on
+  * meanwhile. */
+ static void read_history(char *buffer, size_t buffer_size) {
+     history_snapshot_t snap;
+     take_snapshot(&snap);
+     if (cache_is_complete() && sync_enabled()) { cache_render(buffer, buffer_size, snap.seq); return; }
+     if (!breaker_allow()) { cache_render(buffer, buffer_size, snap.seq); return; }
+     int64_t t0 = breaker_now_ms();
+     int rc = fetch_messages_from_db_pool(buffer, buffer_size, &snap.upto);
+     breaker_record(rc == 0, breaker_now_ms() - t0);
+     if (rc != 0) cache_render(buffer, buffer_size, snap.seq);
+ }
+ 
+
+ /* Copy a loaded document's text and author into m. Loading is a read, so
+  * the author gets an id only while intern_limited() has one to give; past
+  * that its name is kept in front of the text, which renders the same
+  * reader line. */
+ static int load_message(chat_msg_t *m, const chat_doc_t *d) {
+     m->author = d->author ? intern_limited(d->author, d->author_len) : 0;
+     char *text;
+     if (d->author && !m->author) {
+         m->len = (size_t)d->author_len + 2 + d->len;
+         if ((text = malloc(m->len + 1)) != NULL) {
+             memcpy(text, d->author, d->author_len);
+             memcpy(text + d->author_len, ": ", 2);
+             memcpy(text + d->author_len + 2, d->text, d->len);
+             text[m->len] = '\0';
+         }
+     } else {
+         m->len = d->len;
+         text = strndup(d->text, d->len);
+     }
+     m->text = text;
+     return text ? 0 : -1;
+ }
+ 
+ /* Room loader for rooms.c: the room's newest messages, oldest first. Messages
+  * stored before rooms existed have no room field and belong to the default
+  * room. */
+ static int load_room(uint32_t room, size_t limit, room_emit_fn emit, void *ctx) {
+     if (!breaker_allow()) return -1;
+     int64_t t0 = breaker_now_ms();
+     mongoc_client_pool_t *pool;
+     mongoc_client_t *client = pop_read_client(&pool);
+     if (!client) { breaker_record(0, breaker_now_ms() - t0); return -1; }
+     mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+ 
+     bson_t *query = room == default_room
+         ? BCON_NEW("$or", "[", "{", "room", BCON_UTF8(CHAT_DEFAULT_ROOM), "}",
+                               "{", "room", "{", "$exists", BCON_BOOL(false), "}", "}", "]")
+         : BCON_NEW("room", BCON_UTF8(intern_str(room)));
+     bson_t *opts = BCON_NEW("sort", "{", "_id", BCON_INT32(-1), "}", "limit", BCON_INT64((int64_t)limit));
+     chat_doc_append_read_opts(opts);
+     mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, read_prefs);
+ 
+     chat_msg_t *msgs = calloc(limit, sizeof(*msgs));
+     size_t n = 0;
+     const bson_t *doc;
+     chat_doc_t d;
+     while (msgs && n < limit && mongoc_cursor_next(cursor, &doc)) {
+         if (chat_doc_decode(doc, &d) != 0 || !d.text) continue;
+         chat_msg_t *m = &msgs[n];
+         if (d.id) memcpy(m->id, d.id->bytes, CHAT_ID_LEN);
+         if (load_message(m, &d) != 0) continue;
+         m->ts_ms = d.ts_ms;
+         m->room = room;
+         n++;
+     }
+     bson_error_t error;
+     int rc = !msgs || mongoc_cursor_error(cursor, &error) ? -1 : 0;
+     breaker_record(rc == 0, breaker_now_ms() - t0);
+     if (rc == 0) {
+         for (size_t i = n; i > 0; i--) emit(ctx, &msgs[i - 1]);
+     } else if (msgs) {
+         fprintf(stderr, "[ROOMS] load of %s failed: %s\n", intern_str(room), error.message);
+     }
+     for (size_t i = 0; i < n; i++) free((char *)msgs[i].text);
+     free(msgs);
+ 
+     mongoc_cursor_destroy(cursor);
+     bson_destroy(query);
+     bson_destroy(opts);
+     mongoc_collection_destroy(coll);
+     mongoc_client_pool_push(pool, client);
+     return rc;
+ }
+ 
+ /* Load the newest cache-capacity messages in commit order. If the whole
+  * collection fits, readers can be served from memory from the start. */
+ static void warm_cache(size_t capacity) {
+     mongoc_client_pool_t *pool;
+     mongoc_client_t *client = pop_read_client(&pool);
+     if (!client) return;
+     mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+ 
+     bson_t *query = bson_new();
+     bson_t *opts = BCON_NEW("sort", "{", "_id", BCON_INT32(-1), "}", "limit", BCON_INT64((int64_t)capacity + 1));
+     chat_doc_append_read_opts(opts);
+     mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, read_prefs);
  
-         time_t sec = millis / 1000;
-         struct tm tm;
-         localtime_r(&sec, &tm);
-         strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+     chat_msg_t *msgs = calloc(capacity + 1, sizeof(*msgs));
+     size_t n = 0, unplaced = 0;
+     const bson_t *doc;
+     chat_doc_t d;
+     while (msgs && n <= capacity && mongoc_cursor_next(cursor, &doc)) {
+         if (chat_doc_decode(doc, &d) != 0) continue;
+         chat_msg_t *m = &msgs[n];
+         if (d.id) memcpy(m->id, d.id->bytes, CHAT_ID_LEN);
+         m->ts_ms = d.ts_ms;
+         m->room = d.room ? intern_limited(d.room, d.room_len) : 0;
+         /* No id left for its room: it can't be filed, so the cache can't
+          * claim the whole history either. */
+         if (d.room && !m->room) { unplaced++; continue; }
+         if (!d.text) { d.text = "(null)"; d.len = 6; }
+         m->text = NULL;
+         load_message(m, &d);
+         n++;
+     }
+     bson_error_t error;
+     int failed = mongoc_cursor_error(cursor, &error);
+     if (failed) fprintf(stderr, "[CACHE] warm-up failed: %s\n", error.message);
+     if (unplaced) fprintf(stderr, "[CACHE] warm-up skipped %zu messages: name table full\n", unplaced);
+     int complete = !failed && !unplaced && n <= capacity;
  
-         char line[1024];
-         snprintf(line, sizeof(line), "[%s] %s\n", timestr, msg);
-         strncat(buffer, line, buffer_size - strlen(buffer) - 1);
+     size_t keep = n > capacity ? capacity : n;
+     for (size_t i = keep; i > 0; i--) {
+         if (msgs[i - 1].text) cache_append(&msgs[i - 1]);
      }
+     for (size_t i = 0; i < n; i++) free((char *)msgs[i].text);
+     free(msgs);
+     cache_set_complete(complete);
+     printf("[CACHE] Warmed with %zu messages%s\n", keep, complete ? " (complete history)" : "");
  
      mongoc_cursor_destroy(cursor);
      bson_destroy(query);
      bson_destroy(opts);
      mongoc_collection_destroy(coll);
+     mongoc_client_pool_push(pool, client);
+ }
+ 
+ /* Indexes the server relies on: {room, _id} for loading a room's newest
+  * messages, {stored} for sync polling, and a unique index on idempotency
+  * keys, only over messages that have one, so a key reused on another
+  * server (or after the local window) is refused by the insert itself. A
+  * failure here is not fatal: rooms load and polls run by scan, and keys
+  * are still deduped locally. */
+ static void ensure_indexes(void) {
+     mongoc_client_t *client = mongoc_client_pool_pop(mongo_pool);
+     mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+     bson_t *cmd = BCON_NEW("createIndexes", BCON_UTF8("chat"),
+                            "indexes", "[", "{",
+                                "key", "{", "room", BCON_INT32(1), "_id", BCON_INT32(-1), "}",
+                                "name", BCON_UTF8("room_1__id_-1"),
+                            "}", "{",
+                                "key", "{", "stored", BCON_INT32(1), "}",
+                                "name", BCON_UTF8("stored_1"),
+                            "}", "{",
+                                "key", "{", "key", BCON_INT32(1), "}",
+                                "name", BCON_UTF8("key_1"),
+                                "unique", BCON_BOOL(true),
+                                "partialFilterExpression", "{", "key", "{", "$exists", BCON_BOOL(true), "}", "}",
+                            "}", "]");
+     bson_error_t error;
+     if (!mongoc_collection_command_simple(coll, cmd, NULL, NULL, &error))
+         fprintf(stderr, "[MongoDB] could not create indexes: %s\n", error.message);
+     bson_destroy(cmd);
+     mongoc_collection_destroy(coll);
      mongoc_client_pool_push(mongo_pool, client);
  }
  
-
+ /* Bound how long a call can block on an unreachable or stalled server so the
+  * breaker sees failures instead of piling up threads. URI options win. */
+ static void apply_db_timeouts(mongoc_uri_t *uri) {
+     const char *env = getenv("CHAT_DB_TIMEOUT_MS");
+     int32_t ms = env && atoi(env) > 0 ? atoi(env) : DEFAULT_DB_TIMEOUT_MS;
+     if (mongoc_uri_get_option_as_int32(uri, MONGOC_URI_SERVERSELECTIONTIMEOUTMS, 0) == 0)
+         mongoc_uri_set_option_as_int32(uri, MONGOC_URI_SERVERSELECTIONTIMEOUTMS, ms);
+     if (mongoc_uri_get_option_as_int32(uri, MONGOC_URI_SOCKETTIMEOUTMS, 0) == 0)
+         mongoc_uri_set_option_as_int32(uri, MONGOC_URI_SOCKETTIMEOUTMS, ms);
+     if (mongoc_uri_get_option_as_int32(uri, MONGOC_URI_CONNECTTIMEOUTMS, 0) == 0)
+         mongoc_uri_set_option_as_int32(uri, MONGOC_URI_CONNECTTIMEOUTMS, ms);
+ }
+ 
+ /* Build the read pools from MONGO_READ_URIS (comma separated, default: the
+  * write URI) with CHAT_READ_PREFERENCE (default secondaryPreferred) and
+  * CHAT_READ_MAX_STALENESS seconds (default: no bound, minimum 90). */
+ static int init_read_pools(const char *write_uri) {
+     const char *mode_env = getenv("CHAT_READ_PREFERENCE");
+     mongoc_read_mode_t mode = MONGOC_READ_SECONDARY_PREFERRED;
+     if (mode_env && *mode_env) {
+         if (strcasecmp(mode_env, "primary") == 0) mode = MONGOC_READ_PRIMARY;
+         else if (strcasecmp(mode_env, "primaryPreferred") == 0) mode = MONGOC_READ_PRIMARY_PREFERRED;
+         else if (strcasecmp(mode_env, "secondary") == 0) mode = MONGOC_READ_SECONDARY;
+         else if (strcasecmp(mode_env, "secondaryPreferred") == 0) mode = MONGOC_READ_SECONDARY_PREFERRED;
+         else if (strcasecmp(mode_env, "nearest") == 0) mode = MONGOC_READ_NEAREST;
+         else { fprintf(stderr, "[MongoDB] unknown CHAT_READ_PREFERENCE: %s\n", mode_env); return -1; }
+     }
+     read_prefs = mongoc_read_prefs_new(mode);
+     const char *stale_env = getenv("CHAT_READ_MAX_STALENESS");
+     if (stale_env && atol(stale_env) > 0) {
+         long stale = atol(stale_env);
+         if (mode == MONGOC_READ_PRIMARY) { fprintf(stderr, "[MongoDB] max staleness needs a non-primary read preference\n"); return -1; }
+         if (stale < 90) stale = 90;   /* server-enforced minimum */
+         mongoc_read_prefs_set_max_staleness_seconds(read_prefs, stale);
+     }
+ 
+     const char *list = getenv("MONGO_READ_URIS");
+     char *copy = strdup(list && *list ? list : write_uri);
+     if (!copy) return -1;
+     char *save = NULL;
+     for (char *u = strtok_r(copy, ",", &save); u; u = strtok_r(NULL, ",", &save)) {
+         if (read_pool_count == MAX_READ_POOLS) { fprintf(stderr, "[MongoDB] ignoring extra read URI %s\n", u); continue; }
+         mongoc_uri_t *uri = mongoc_uri_new(u);
+         if (!uri) { fprintf(stderr, "[MongoDB] invalid read URI %s\n", u); free(copy); return -1; }
+         apply_db_timeouts(uri);
+         mongoc_uri_set_read_prefs_t(uri, read_prefs);
+         mongoc_client_pool_t *pool = mongoc_client_pool_new(uri);
+         mongoc_uri_destroy(uri);
+         if (!pool) { fprintf(stderr, "[MongoDB] read pool creation failed for %s\n", u); free(copy); return -1; }
+         read_pools[read_pool_count++] = pool;
+         printf("[MongoDB] Read pool created for %s\n", u);
+     }
+     free(copy);
+     return read_pool_count > 0 ? 0 : -1;
+ }
+ 
+ /* A writer's replies to one read, sent together once the read is handled
+  * so a pipelined burst of commands gets one send, not one per command. */
+ typedef struct reply_buf {
+     int sock;
+     size_t len;
+     char data[BUFFER_SIZE];
+ } reply_buf_t;
+ 
+ static void reply_flush(reply_buf_t *out) {
+     if (out->len == 0) return;
+     struct iovec iov = { out->data, out->len };
+     net_sendv(out->sock, &iov, 1);
+     out->len = 0;
+ }
+ 
+ static void reply(reply_buf_t *out, const char *s, size_t len) {
+     if (out->len + len > sizeof(out->data)) reply_flush(out);
+     if (len > sizeof(out->data)) {
+         struct iovec iov = { (void *)s, len };
+         net_sendv(out->sock, &iov, 1);
+         return;
+     }
+     memcpy(out->data + out->len, s, len);
+     out->len += len;
+ }
+ 
+ /* Session options a writer may send at any time: "@room <name>",
+  * "@user <name>" and "@class <tier|room>". They share the '@' escape with
+  * message flags so that plain text is always message text. Returns 1 if
+  * the line was one of them. */
+ static int writer_option(reply_buf_t *out, const char *line, writer_state_t *st) {
+     char line_out[160];
+     if (line[0] != '@') return 0;
+     line++;
+     if (strncmp(line, "room ", 5) == 0 || strncmp(line, "user ", 5) == 0) {
+         const char *name = line + 5;
+         int is_room = line[0] == 'r';
+         int valid = valid_name(name);
+         uint32_t id = valid ? intern(name, strlen(name)) : 0;
+         if (!valid) {
+             reply(out, is_room ? "ERROR: invalid room name\n" : "ERROR: invalid user name\n", 25);
+         } else if (id == 0) {
+             reply(out, "ERROR: too many distinct names\n", 31);
+         } else if (is_room) {
+             st->room = id;
+             int n = snprintf(line_out, sizeof(line_out), "OK: room %s (%s)\n", intern_str(id), tier_names[room_tier(id)]);
+             reply(out, line_out, (size_t)n);
+         } else {
+             st->author = id;
+             int n = snprintf(line_out, sizeof(line_out), "OK: user %s\n", intern_str(id));
+             reply(out, line_out, (size_t)n);
+         }
+         return 1;
+     }
+     if (strncmp(line, "class ", 6) == 0) {
+         const char *name = line + 6;
+         int tier = strcmp(name, "room") == 0 ? -1 : parse_tier(name, strlen(name));
+         if (tier < 0 && strcmp(name, "room") != 0) {
+             reply(out, "ERROR: class must be ephemeral, default, audited or room\n", 57);
+         } else {
+             st->tier = tier;
+             int n = snprintf(line_out, sizeof(line_out), "OK: class %s\n", tier < 0 ? "room" : tier_names[tier]);
+             reply(out, line_out, (size_t)n);
+         }
+         return 1;
+     }
+     return 0;
+ }
+ 
+ /* Strip leading message flags, "@tier " and "@key:<k> ", and pick the
+  * effective tier. Anything else starting with '@' is message text. */
+ static const char *message_flags(const char *line, const writer_state_t *st, int *tier, char key[IDEM_KEY_MAX + 1]) {
+     int room_t = room_tier(st->room);
+     *tier = st->tier >= 0 ? st->tier : room_t;
+     key[0] = '\0';
+     while (line[0] == '@') {
+         const char *sp = strchr(line, ' ');
+         if (!sp) break;
+         size_t n = (size_t)(sp - line - 1);
+         int t = parse_tier(line + 1, n);
+         if (t >= 0) {
+             *tier = t;
+         } else if (n > 4 && strncmp(line + 1, "key:", 4) == 0 && idem_valid_key(line + 5, n - 4)) {
+             memcpy(key, line + 5, n - 4);
+             key[n - 4] = '\0';
+         } else {
+             break;
+         }
+         line = sp + 1;
+     }
+     if (room_t == TIER_AUDITED) *tier = TIER_AUDITED;
+     return line;
+ }
+ 
+ /* Insert with an optional idempotency key claimed first. */
+ static char *store_message(const char *text, size_t len, const writer_state_t *st, int tier, const char *key) {
+     if (!key || !key[0]) return insert_message_to_db_pool(text, len, st->room, st->author, NULL, tier);
+ 
+     if (idem_claim(key, strlen(key))) return strdup("OK: duplicate message ignored\n");
+     char *res = insert_message_to_db_pool(text, len, st->room, st->author, key, tier);
+     if (strncmp(res, "ERROR", 5) == 0) idem_release(key, strlen(key));
+     return res;
+ }
+ 
+ static char *write_message(const char *line, const writer_state_t *st) {
+     int tier;
+     char key[IDEM_KEY_MAX + 1];
+     const char *text = message_flags(line, st, &tier, key);
+     if (*text == '\0') return strdup("ERROR: empty message\n");
+     return store_message(text, strlen(text), st, tier, key);
+ }
+ 
+ #define HTTP_WRITER_WAIT_MS 2000
+ 
+ static uint32_t name_id(const char *name) {
+     return valid_name(name) ? intern(name, strlen(name)) : 0;
+ }
+ 
+ /* Room lookup for HTTP reads and streams; see http_room_fn. */
+ static uint32_t room_lookup(const char *name, int follow) {
+     if (!valid_name(name)) return 0;
+     uint32_t id = follow ? intern_limited(name, strlen(name)) : intern_find(name, strlen(name));
+     return id ? id : HTTP_ROOM_UNKNOWN;
+ }
+ 
+ /* POST /messages: a one-message writer session. It waits a bounded time
+  * for the writer lock rather than queueing behind a session that may
+  * never stop. */
+ static int http_post(const http_post_t *post, char *reply, size_t size) {
+     writer_state_t st = { default_room, 0, -1 };
+     if (post->room && !(st.room = name_id(post->room))) { snprintf(reply, size, "ERROR: invalid room name"); return 400; }
+     if (post->user && !(st.author = name_id(post->user))) { snprintf(reply, size, "ERROR: invalid user name"); return 400; }
+     int room_t = room_tier(st.room);
+     int tier = room_t;
+     if (post->cls && strcmp(post->cls, "room") != 0) {
+         tier = parse_tier(post->cls, strlen(post->cls));
+         if (tier < 0) { snprintf(reply, size, "ERROR: class must be ephemeral, default, audited or room"); return 400; }
+     }
+     if (room_t == TIER_AUDITED) tier = TIER_AUDITED;
+     if (post->key && !idem_valid_key(post->key, strlen(post->key))) { snprintf(reply, size, "ERROR: invalid idempotency key"); return 400; }
+ 
+     struct timespec deadline;
+     clock_gettime(CLOCK_REALTIME, &deadline);
+     deadline.tv_nsec += (HTTP_WRITER_WAIT_MS % 1000) * 1000000L;
+     deadline.tv_sec += HTTP_WRITER_WAIT_MS / 1000 + deadline.tv_nsec / 1000000000L;
+     deadline.tv_nsec %= 1000000000L;
+     int rc;
+     while ((rc = sem_timedwait(&wrt, &deadline)) != 0 && errno == EINTR) {}
+     if (rc != 0) { snprintf(reply, size, "ERROR: another writer session is active"); return 409; }
+     char *res = store_message(post->message, post->message_len, &st, tier, post->key);
+     sem_post(&wrt);
+ 
+     snprintf(reply, size, "%s", res ? res : "ERROR: out of memory");
+     int status = !res || strncmp(res, "ERROR", 5) == 0 ? 503
+                : strstr(res, "duplicate") ? 200
+                : strstr(res, "queued") ? 202 : 201;
+     free(res);
+     return status;
+ }
+ 
+ /* A writer connection's state across reads. */
+ typedef struct writer_session {
+     writer_state_t st;
+     int has_lock;
+     int pipelined;
+     int overlong;        /* discarding a line too long for the buffer */
+     size_t partial_len;
+     char partial[BUFFER_SIZE];
+     reply_buf_t out;
+ } writer_session_t;
+ 
+ /* One writer command. Returns 1 when the session should end. */
+ static int writer_command(int sock, char *cmd, writer_session_t *ws) {
+     if (strlen(cmd) == 0) return 0;
+ 
+     if (writer_option(&ws->out, cmd, &ws->st)) {
+         return 0;
+     } else if (strcmp(cmd, "start") == 0) {
+         /* The lock may be a long wait; don't hold earlier replies over it. */
+         reply_flush(&ws->out);
+         sem_wait(&wrt);
+         ws->has_lock = 1;
+         reply(&ws->out, "OK: writer session started\n", 27);
+         printf("[SERVER] Writer STARTED (sock=%d)\n", sock);
+     } else if (strcmp(cmd, "stop") == 0) {
+         if (ws->has_lock) {
+             ws->has_lock = 0;
+             sem_post(&wrt);
+             reply(&ws->out, "OK: writer session stopped\n", 27);
+             printf("[SERVER] Writer STOPPED (sock=%d)\n", sock);
+         } else {
+             reply(&ws->out, "ERROR: no active writer session\n", 32);
+         }
+     } else if (strcmp(cmd, "exit") == 0) {
+         return 1;
+     } else {
+         if (!ws->has_lock) {
+             reply(&ws->out, "ERROR: You must start writing first\n", 36);
+             printf("[SERVER] Rejected write (sock=%d, no lock)\n", sock);
+             return 0;
+         }
+         char *res = write_message(cmd, &ws->st);
+         reply(&ws->out, res, strlen(res));
+         free(res);
+     }
+     return 0;
+ }
+ 
+ /* One read of writer input (data[len] must be writable). A classic
+  * session takes each read as one command. After a "pipeline" command
+  * (answered "OK: pipelined") commands are newline-terminated lines, any
+  * number per read and split across reads freely; every non-empty line gets
+  * exactly one reply line, in order, so a client can keep many in flight.
+  * The replies to one read leave together when it has been handled.
+  * Returns 1 when the session should end. */
+ static int writer_input(int sock, char *data, size_t len, writer_session_t *ws) {
+     int done = 0;
+     if (!ws->pipelined) {
+         if (len < 8 || memcmp(data, "pipeline", 8) != 0 || (len > 8 && data[8] != '\r' && data[8] != '\n')) {
+             data[len] = '\0';
+             rtrim(data);
+             done = writer_command(sock, data, ws);
+             reply_flush(&ws->out);
+             return done;
+         }
+         ws->pipelined = 1;
+         reply(&ws->out, "OK: pipelined\n", 14);
+         size_t skip = len > 8 && data[8] == '\r' ? 9 : 8;
+         if (len > skip && data[skip] == '\n') skip++;
+         if (skip > len) skip = len;
+         data += skip;
+         len -= skip;
+     }
+     for (size_t i = 0; i < len; i++) {
+         char c = data[i];
+         if (c != '\n') {
+             if (ws->partial_len < sizeof(ws->partial) - 1) ws->partial[ws->partial_len++] = c;
+             else ws->overlong = 1;
+             continue;
+         }
+         ws->partial[ws->partial_len] = '\0';
+         ws->partial_len = 0;
+         if (ws->overlong) {
+             ws->overlong = 0;
+             reply(&ws->out, "ERROR: line too long\n", 21);
+             continue;
+         }
+         rtrim(ws->partial);
+         if ((done = writer_command(sock, ws->partial, ws))) break;
+     }
+     reply_flush(&ws->out);
+     return done;
+ }
+ 
+ enum { ROLE_UNKNOWN, ROLE_WRITER, ROLE_READER, ROLE_SUBSCRIBER };
+ 
+ /* Split the first read into role and first command ("writer start",
+  * "reader room x", ...), so a client that sends both in one segment is
+  * served from that single read. *rest points past the role token. */
+ static int parse_role(char *initial, char **rest) {
+     static const struct { const char *name; size_t len; int role; } roles[] = {
+         { "writer", 6, ROLE_WRITER }, { "reader", 6, ROLE_READER }, { "subscriber", 10, ROLE_SUBSCRIBER },
+     };
+     int role = ROLE_UNKNOWN;
+     char *p = initial;
+     for (size_t i = 0; i < sizeof(roles) / sizeof(roles[0]); i++) {
+         if (strncmp(initial, roles[i].name, roles[i].len) == 0) { role = roles[i].role; p = initial + roles[i].len; break; }
+     }
+     if (role == ROLE_UNKNOWN) {
+         // If input had both role and payload in one frame, extract role token
+         if ((p = strstr(initial, "writer")) != NULL) { role = ROLE_WRITER; p += 6; }
+         else if ((p = strstr(initial, "reader")) != NULL) { role = ROLE_READER; p += 6; }
+         else p = initial;
+     }
+     while (*p == ' ' || *p == '\n' || *p == '\r') p++;
+     *rest = p;
+     return role;
+ }
+ 
+ /* Handed to each connection thread: the socket and its listener's profile. */
+ typedef struct conn {
+     int sock;
+     const net_profile_t *profile;
+ } conn_t;
+ 
+ void *handle_client(void *arg);
+ 
+ /* A mux stream: a session like any other, on one end of a socketpair. */
+ static int spawn_session(int fd, void *ctx) {
+     (void)ctx;
+     conn_t *conn = malloc(sizeof(*conn));
+     if (!conn) return -1;
+     conn->sock = fd;
+     conn->profile = &net_default_profile;
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, handle_client, conn) != 0) { free(conn); return -1; }
+     pthread_detach(tid);
+     return 0;
+ }
+ 
  void *handle_client(void *arg) {
-     int sock = *(int *)arg;
-     free(arg);
+     conn_t *conn = arg;
+     int sock = conn->sock;
+     const net_profile_t *profile = conn->profile;
+     free(conn);
+     net_setup_conn(sock, profile);
      char initial[BUFFER_SIZE];
-     ssize_t r = recv(sock, initial, sizeof(initial)-1, 0);
+     ssize_t r = net_recv_first(sock, initial, sizeof(initial)-1);
      if (r <= 0) { close(sock); return NULL; }
+     if (http_detect(initial, (size_t)r)) {
+         http_serve(sock, initial, (size_t)r);
+         return NULL;
+     }
+     if (r >= 4 && memcmp(initial, "mux\n", 4) == 0) {
+         /* Binary frames may follow in the same read; hand them over raw. */
+         mux_serve(sock, initial + 4, (size_t)r - 4, spawn_session, NULL);
+         return NULL;
+     }
      initial[r] = '\0';
+     int initial_nl = initial[r - 1] == '\n';
      rtrim(initial);
  
-     /* Determine role robustly */
-     char mode[16] = {0};
-     if (strncmp(initial, "writer", 6) == 0) strcpy(mode, "writer");
-     else if (strncmp(initial, "reader", 6) == 0) strcpy(mode, "reader");
-     else {
-         // If input had both role and payload in one frame, extract role token
-         if (strstr(initial, "writer") != NULL) strcpy(mode, "writer");
-         else if (strstr(initial, "reader") != NULL) strcpy(mode, "reader");
-     }
+     char *rest;
+     int role = parse_role(initial, &rest);
  
-     if (strcmp(mode, "writer") == 0) {
+     if (role == ROLE_WRITER) {
          printf("[SERVER] Writer connected (sock=%d)\n", sock);
-         char buf[BUFFER_SIZE];
+         char buf[BUFFER_SIZE + 1];
          int n;
-         int has_lock = 0;
-
-         char *p_after = NULL;
-         if (strlen(initial) > 6) { p_after = initial + 6; while (*p_after==' '||*p_after=='\n'||*p_after=='\r') p_after++; if (*p_after) rtrim(p_after); }
- 
-         if (p_after && strlen(p_after) > 0) {
-             if (strcmp(p_after, "start") == 0) {
-                 sem_wait(&wrt);
-                 has_lock = 1;
-                 send(sock, "OK: writer session started\n", 26, 0);
-                 printf("[SERVER] Writer STARTED (sock=%d)\n", sock);
-             } else if (strcmp(p_after, "stop") == 0) {
- 
-                 send(sock, "OK: writer session stopped\n", 26, 0);
-             } else {
-                 if (!has_lock) {
-                     send(sock, "ERROR: start writing first\n", 27, 0);
-                 } else {
-                     char *res = insert_message_to_db_pool(p_after);
-                     send(sock, res, strlen(res), 0);
-                     free(res);
-                 }
-             }
+         writer_session_t ws = { { default_room, 0, -1 }, 0, 0, 0, 0, {0}, { sock, 0, {0} } };
+         char *p_after = rest;
+         int done = 0;
+ 
+         if (strcmp(p_after, "stop") == 0) {
+             send(sock, "OK: writer session stopped\n", 27, 0);
+         } else if (strlen(p_after) > 0) {
+             /* Give back the newline rtrim took, for pipelined framing. */
+             if (initial_nl) strcat(p_after, "\n");
+             done = writer_input(sock, p_after, strlen(p_after), &ws);
          }
  
-         while ((n = recv(sock, buf, sizeof(buf)-1, 0)) > 0) {
-             buf[n] = '\0';
-             rtrim(buf);
-             if (strlen(buf) == 0) continue;
- 
-             if (strcmp(buf, "start") == 0) {
-                 sem_wait(&wrt);
-                 has_lock = 1;
-                 send(sock, "OK: writer session started\n", 26, 0);
-                 printf("[SERVER] Writer STARTED (sock=%d)\n", sock);
-             } else if (strcmp(buf, "stop") == 0) {
-                 if (has_lock) {
-                     has_lock = 0;
-                     sem_post(&wrt);
-                     send(sock, "OK: writer session stopped\n", 26, 0);
-                     printf("[SERVER] Writer STOPPED (sock=%d)\n", sock);
-                 } else {
-                     send(sock, "ERROR: no active writer session\n", 32, 0);
-                 }
-             } else if (strcmp(buf, "exit") == 0) {
-                 break;
-             } else {
-                 if (!has_lock) {
-                     send(sock, "ERROR: You must start writing first\n", 36, 0);
-                     printf("[SERVER] Rejected write (sock=%d, no lock)\n", sock);
-                     continue;
-                 }
-                 char *res = insert_message_to_db_pool(buf);
-                 send(sock, res, strlen(res), 0);
-                 free(res);
-             }
+         while (!done && (n = net_recv(sock, buf, sizeof(buf)-1, profile)) > 0) {
+             done = writer_input(sock, buf, (size_t)n, &ws);
          }
  
-         if (has_lock) {
+         if (ws.has_lock) {
              sem_post(&wrt);
              printf("[SERVER] Writer lock auto-released (sock=%d)\n", sock);
          }
@@ -212,27 +1004,45 @@
          close(sock);
          return NULL;
      }
-     else if (strcmp(mode, "reader") == 0) {
+     else if (role == ROLE_READER) {
          printf("[SERVER] Reader connected (sock=%d)\n", sock);
-         sem_wait(&mutex);
-         reader_count++;
-         if (reader_count == 1) sem_wait(&wrt);
-         sem_post(&mutex);
- 
-         printf("[SERVER] Reader entered critical section (reading messages)...\n");
          char out[BUFFER_SIZE * 8];
-         fetch_messages_from_db_pool(out, sizeof(out));
+         const char *arg = rest;
+         if (strncmp(arg, "room ", 5) == 0) {
+             /* "reader room <name>": that room's recent messages; a room
+              * nobody wrote to has none */
+             int valid = valid_name(arg + 5);
+             uint32_t room = valid ? intern_find(arg + 5, strlen(arg + 5)) : 0;
+             if (!valid) snprintf(out, sizeof(out), "ERROR: invalid room name\n");
+             else if (!room) out[0] = '\0';
+             else if (rooms_render(room, out, sizeof(out)) != 0) snprintf(out, sizeof(out), "ERROR: room history unavailable\n");
+         } else if (strcmp(arg, "stats") == 0) {
+             FILE *f = fmemopen(out, sizeof(out), "w");
+             if (f) { mem_report(f); rooms_report(f); fclose(f); }
+             else snprintf(out, sizeof(out), "ERROR: stats unavailable\n");
+         } else {
+             read_history(out, sizeof(out));
+         }
          send(sock, out, strlen(out), 0);
  
-         sem_wait(&mutex);
-         reader_count--;
-         if (reader_count == 0) sem_post(&wrt);
-         sem_post(&mutex);
- 
          printf("[SERVER] Reader finished and disconnected (sock=%d)\n", sock);
          close(sock);
          return NULL;
      }
+     else if (role == ROLE_SUBSCRIBER) {
+         /* "subscriber room <name>" follows one room and keeps it hot */
+         const char *arg = rest;
+         uint32_t room = 0;
+         if (strncmp(arg, "room ", 5) == 0) {
+             if (!valid_name(arg + 5)) { send(sock, "ERROR: invalid room name\n", 25, 0); close(sock); return NULL; }
+             room = intern_limited(arg + 5, strlen(arg + 5));
+             if (!room) { send(sock, "ERROR: too many distinct names\n", 31, 0); close(sock); return NULL; }
+         }
+         int pinned = room && rooms_pin(room) == 0;
+         subscriber_serve(sock, room, SUB_TEXT, NULL);
+         if (pinned) rooms_unpin(room);
+         return NULL;
+     }
      else {
          printf("[SERVER] Unknown role received: %s\n", initial);
          close(sock);
@@ -248,52 +1058,92 @@
  
      mongoc_uri_t *uri = mongoc_uri_new(mongo_uri_env);
      if (!uri) { fprintf(stderr, "[MongoDB] invalid URI\n"); return EXIT_FAILURE; }
+     apply_db_timeouts(uri);
  
      mongo_pool = mongoc_client_pool_new(uri);
      mongoc_uri_destroy(uri);
      if (!mongo_pool) { fprintf(stderr, "[MongoDB] client pool creation failed\n"); mongoc_cleanup(); return EXIT_FAILURE; }
      printf("[MongoDB] Client pool created for %s\n", mongo_uri_env);
+     if (init_read_pools(mongo_uri_env) != 0) { mongoc_client_pool_destroy(mongo_pool); mongoc_cleanup(); return EXIT_FAILURE; }
  
-     if (sem_init(&mutex, 0, 1) != 0) { perror("sem_init mutex"); return EXIT_FAILURE; }
      if (sem_init(&wrt, 0, 1) != 0) { perror("sem_init wrt"); return EXIT_FAILURE; }
+     if (pthread_key_create(&doc_buffer_key, doc_buffer_free) != 0) { perror("pthread_key_create"); return EXIT_FAILURE; }
+     if (mem_init() != 0) return EXIT_FAILURE;
+     const char *intern_env = getenv("CHAT_INTERN_MAX");
+     size_t intern_max = intern_env && atol(intern_env) > 0 ? (size_t)atol(intern_env) : DEFAULT_INTERN_MAX;
+     if (intern_init(intern_max) != 0) { fprintf(stderr, "[SERVER] intern table init failed\n"); return EXIT_FAILURE; }
+     default_room = intern(CHAT_DEFAULT_ROOM, strlen(CHAT_DEFAULT_ROOM));
+     if (rooms_init(default_room, intern_max, load_room) != 0) { fprintf(stderr, "[ROOMS] init failed\n"); return EXIT_FAILURE; }
+     const char *cache_env = getenv("CHAT_CACHE_SIZE");
+     size_t cache_size = cache_env && atol(cache_env) > 0 ? (size_t)atol(cache_env) : DEFAULT_CACHE_SIZE;
+     const char *arena_env = getenv("CHAT_CACHE_ARENA_BYTES");
+     size_t arena_bytes = arena_env && atol(arena_env) > 0 ? (size_t)atol(arena_env) : cache_size * DEFAULT_CACHE_TEXT_BYTES;
+     if (arena_bytes < CACHE_TEXT_MAX) arena_bytes = CACHE_TEXT_MAX;
+     if (cache_init(cache_size, arena_bytes) != 0) { fprintf(stderr, "[CACHE] init failed\n"); return EXIT_FAILURE; }
+     warm_cache(cache_size);
+     if (subscriber_init() != 0) { fprintf(stderr, "[SERVER] subscriber init failed\n"); return EXIT_FAILURE; }
+     if (webhook_init() != 0) { fprintf(stderr, "[WEBHOOK] invalid configuration\n"); return EXIT_FAILURE; }
+     /* Every commit listener is subscribed by now; the threads started from
+      * here on may publish. */
+     if (sync_init(mongo_pool) != 0) { fprintf(stderr, "[SYNC] invalid configuration\n"); return EXIT_FAILURE; }
+     breaker_init();
+     if (spool_init(mongo_pool) != 0) { fprintf(stderr, "[SPOOL] init failed\n"); return EXIT_FAILURE; }
+     if (init_write_concerns() != 0) { fprintf(stderr, "[MongoDB] write concern setup failed\n"); return EXIT_FAILURE; }
+     http_init(http_post, room_lookup);
+     if (mux_init() != 0) { fprintf(stderr, "[MUX] invalid configuration\n"); return EXIT_FAILURE; }
+     if (idem_init() != 0) { fprintf(stderr, "[SERVER] idempotency table init failed\n"); return EXIT_FAILURE; }
+     ensure_indexes();
+     mem_report(stdout);
  
-     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-     if (server_fd < 0) { perror("socket"); return EXIT_FAILURE; }
- 
-     int opt = 1;
-     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-     struct sockaddr_in addr = {0};
-     addr.sin_family = AF_INET; addr.sin_port = htons(PORT); addr.sin_addr.s_addr = INADDR_ANY;
- 
-     if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); return EXIT_FAILURE; }
-     if (listen(server_fd, MAX_CLIENTS) < 0) { perror("listen"); return EXIT_FAILURE; }
+     net_listener_t listeners[NET_MAX_LISTENERS];
+     int listener_count = net_listen_all(listeners, NET_MAX_LISTENERS, PORT, MAX_CLIENTS);
+     if (listener_count <= 0) { fprintf(stderr, "[NET] no usable listener\n"); return EXIT_FAILURE; }
+     struct pollfd pfds[NET_MAX_LISTENERS];
+     for (int i = 0; i < listener_count; i++) { pfds[i].fd = listeners[i].fd; pfds[i].events = POLLIN; }
  
      printf("=========================================\n");
      printf(" Reader–Writer Server with MongoDB Ready\n");
-     printf(" Listening on port %d\n", PORT);
+     for (int i = 0; i < listener_count; i++)
+         printf(" Listening on port %d (%s)\n", listeners[i].port, listeners[i].profile->name);
      printf("=========================================\n");
  
      while (running) {
-         struct sockaddr_in client_addr; socklen_t client_len = sizeof(client_addr);
-         int client = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-         if (client < 0) {
-             if (errno == EINTR && !running) break;
-             perror("accept"); continue;
+         if (poll(pfds, (nfds_t)listener_count, -1) < 0) {
+             if (errno == EINTR) continue;
+             perror("poll"); break;
          }
-         int *pclient = malloc(sizeof(int));
-         if (!pclient) { close(client); continue; }
-         *pclient = client;
-         pthread_t tid;
-         if (pthread_create(&tid, NULL, handle_client, pclient) != 0) {
-             perror("pthread_create"); close(client); free(pclient); continue;
+         for (int i = 0; i < listener_count; i++) {
+             if (!(pfds[i].revents & POLLIN)) continue;
+             struct sockaddr_in client_addr; socklen_t client_len = sizeof(client_addr);
+             int client = accept(listeners[i].fd, (struct sockaddr *)&client_addr, &client_len);
+             if (client < 0) {
+                 if (errno != EINTR && errno != EAGAIN) perror("accept");
+                 continue;
+             }
+             conn_t *conn = malloc(sizeof(*conn));
+             if (!conn) { close(client); continue; }
+             conn->sock = client;
+             conn->profile = listeners[i].profile;
+             pthread_t tid;
+             if (pthread_create(&tid, NULL, handle_client, conn) != 0) {
+                 perror("pthread_create"); close(client); free(conn); continue;
+             }
+             pthread_detach(tid);
          }
-         pthread_detach(tid);
      }
  
-     close(server_fd);
+     for (int i = 0; i < listener_count; i++) close(listeners[i].fd);
+     sync_shutdown();
+     spool_shutdown();
+     webhook_shutdown();
      if (mongo_pool) mongoc_client_pool_destroy(mongo_pool);
+     for (int i = 0; i < read_pool_count; i++) mongoc_client_pool_destroy(read_pools[i]);
+     if (read_prefs) mongoc_read_prefs_destroy(read_prefs);
+     for (int t = 0; t < TIER_COUNT; t++) if (tier_opts[t]) bson_destroy(tier_opts[t]);
      mongoc_cleanup();
-     sem_destroy(&mutex); sem_destroy(&wrt);
+     sem_destroy(&wrt);
+     mem_report(stdout);
+     rooms_report(stdout);
      printf("[SERVER] Shutdown complete.\n");
      return 0;
  }
@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <bson/bson.h>
+#include <mongoc/mongoc.h>
+
+#include "breaker.h"
+#include "spool.h"
+
+#define SPOOL_DRAIN_INTERVAL_MS 500
+#define MONGO_DUPLICATE_KEY 11000
+
+static mongoc_client_pool_t *spool_pool = NULL;
+static char spool_path[512] = "chat_spool.log";
+static char drain_path[528];
+static char rejected_path[528];
+static FILE *spool_out = NULL;
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t drain_tid;
+static volatile int stopping = 0;
+static int started = 0;
+
+/* Records are "oid\tts_ms\troom\tauthor\tkey\ttext\n" with \\, \t and \n escaped
+ * in text; author and key are empty when the message has none. Records
+ * spooled before keys were, without the key field, still drain. */
+int spool_write(const bson_oid_t *oid, int64_t ts_ms, const char *room, const char *author, const char *key, const char *text) {
+    char hex[25];
+    bson_oid_to_string(oid, hex);
+
+    pthread_mutex_lock(&spool_lock);
+    if (!spool_out) spool_out = fopen(spool_path, "a");
+    if (!spool_out) {
+        pthread_mutex_unlock(&spool_lock);
+        perror("[SPOOL] open");
+        return -1;
+    }
+    fprintf(spool_out, "%s\t%lld\t%s\t%s\t%s\t", hex, (long long)ts_ms, room, author, key ? key : "");
+    for (const char *p = text; *p; p++) {
+        if (*p == '\\') fputs("\\\\", spool_out);
+        else if (*p == '\t') fputs("\\t", spool_out);
+        else if (*p == '\n') fputs("\\n", spool_out);
+        else fputc(*p, spool_out);
+    }
+    fputc('\n', spool_out);
+    int rc = fflush(spool_out) == 0 ? 0 : -1;
+    pthread_mutex_unlock(&spool_lock);
+    return rc;
+}
+
+static void unescape(char *s) {
+    char *w = s;
+    for (char *r = s; *r; r++) {
+        if (*r == '\\' && r[1]) {
+            r++;
+            *w++ = *r == 't' ? '\t' : *r == 'n' ? '\n' : *r;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+}
+
+static int file_has_data(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size > 0;
+}
+
+int spool_error_transient(const bson_error_t *error) {
+    switch (error->domain) {
+    case MONGOC_ERROR_STREAM:
+    case MONGOC_ERROR_SERVER_SELECTION:
+        return 1;
+    default:
+        break;
+    }
+    switch (error->code) {
+    case 6:     /* HostUnreachable */
+    case 7:     /* HostNotFound */
+    case 50:    /* MaxTimeMSExpired */
+    case 64:    /* WriteConcernFailed */
+    case 89:    /* NetworkTimeout */
+    case 91:    /* ShutdownInProgress */
+    case 189:   /* PrimarySteppedDown */
+    case 262:   /* ExceededTimeLimit */
+    case 9001:  /* SocketException */
+    case 10107: /* NotWritablePrimary */
+    case 11600: /* InterruptedAtShutdown */
+    case 11602: /* InterruptedDueToReplStateChange */
+    case 13435: /* NotPrimaryNoSecondaryOk */
+    case 13436: /* NotPrimaryOrSecondary */
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Set a record that can never be inserted aside, so it doesn't hold up the
+ * rest of the spool. A record cut short by a crash may lack its newline. */
+static void reject_record(const char *line, const char *why) {
+    size_t len = strlen(line);
+    FILE *f = fopen(rejected_path, "a");
+    if (!f || fputs(line, f) < 0 || (len && line[len - 1] != '\n' && fputc('\n', f) == EOF) || fclose(f) != 0)
+        perror("[SPOOL] rejected log");
+    fprintf(stderr, "[SPOOL] Record %s, moved to %s\n", why, rejected_path);
+}
+
+/* Insert one spooled record. Returns 1 on success (including "already
+ * there" and records set aside as rejected), 0 on a transient failure. */
+static int drain_record(mongoc_collection_t *coll, char *line) {
+    char *raw = strdup(line);
+    char *fields[6];
+    int n = 0;
+    line[strcspn(line, "\n")] = '\0';
+    /* Text has its tabs escaped, so every tab separates fields; author and
+     * key may be empty: no strtok. */
+    for (char *p = line; p && n < 6; n++) {
+        fields[n] = p;
+        if ((p = strchr(p, '\t'))) *p++ = '\0';
+    }
+    if (n != 6 || !bson_oid_is_valid(fields[0], strlen(fields[0]))) {
+        if (raw) reject_record(raw, "malformed");
+        free(raw);
+        return 1;
+    }
+    const char *key = fields[4];
+    char *text = fields[5];
+    unescape(text);
+
+    bson_oid_t oid;
+    bson_oid_init_from_string(&oid, fields[0]);
+    bson_t *doc = bson_new();
+    BSON_APPEND_OID(doc, "_id", &oid);
+    BSON_APPEND_UTF8(doc, "message", text);
+    BSON_APPEND_DATE_TIME(doc, "timestamp", strtoll(fields[1], NULL, 10));
+    /* Stored now, not when spooled: peers polling for new inserts by this
+     * field must see the record even though its _id and timestamp are old. */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    BSON_APPEND_DATE_TIME(doc, "stored", (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    BSON_APPEND_UTF8(doc, "room", fields[2]);
+    if (*fields[3]) BSON_APPEND_UTF8(doc, "author", fields[3]);
+    if (*key) BSON_APPEND_UTF8(doc, "key", key);
+
+    bson_error_t error;
+    int64_t t0 = breaker_now_ms();
+    int ok = mongoc_collection_insert_one(coll, doc, NULL, NULL, &error);
+    if (!ok && error.code == MONGO_DUPLICATE_KEY) ok = 1;
+    if (!ok && !spool_error_transient(&error)) {
+        /* The database answered; it's the record that is bad. */
+        fprintf(stderr, "[SPOOL] insert rejected: %s\n", error.message);
+        if (raw) reject_record(raw, "rejected by MongoDB");
+        ok = 1;
+    }
+    breaker_record(ok, breaker_now_ms() - t0);
+    bson_destroy(doc);
+    free(raw);
+    return ok;
+}
+
+/* Move the live spool aside and replay it. On failure the draining file is
+ * kept and replayed from the start next time; duplicates are harmless. */
+static void drain(void) {
+    if (!file_has_data(drain_path)) {
+        pthread_mutex_lock(&spool_lock);
+        if (file_has_data(spool_path)) {
+            if (spool_out) { fclose(spool_out); spool_out = NULL; }
+            rename(spool_path, drain_path);
+        }
+        pthread_mutex_unlock(&spool_lock);
+        if (!file_has_data(drain_path)) return;
+    }
+
+    FILE *in = fopen(drain_path, "r");
+    if (!in) return;
+    mongoc_client_t *client = mongoc_client_pool_pop(spool_pool);
+    mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+
+    char *line = NULL;
+    size_t cap = 0;
+    long drained = 0;
+    int complete = 1;
+    while (!stopping && getline(&line, &cap, in) > 0) {
+        if (!breaker_allow() || !drain_record(coll, line)) { complete = 0; break; }
+        drained++;
+    }
+    free(line);
+    fclose(in);
+    mongoc_collection_destroy(coll);
+    mongoc_client_pool_push(spool_pool, client);
+
+    if (complete && !stopping) {
+        unlink(drain_path);
+        printf("[SPOOL] Drained %ld spooled messages into MongoDB\n", drained);
+    }
+}
+
+static void *drain_thread(void *arg) {
+    (void)arg;
+    while (!stopping) {
+        struct timespec ts = { 0, SPOOL_DRAIN_INTERVAL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+        if (breaker_state() == BREAKER_CLOSED) drain();
+    }
+    return NULL;
+}
+
+int spool_init(mongoc_client_pool_t *pool) {
+    const char *path = getenv("CHAT_SPOOL_PATH");
+    if (path && *path) snprintf(spool_path, sizeof(spool_path), "%s", path);
+    snprintf(drain_path, sizeof(drain_path), "%s.draining", spool_path);
+    snprintf(rejected_path, sizeof(rejected_path), "%s.rejected", spool_path);
+    spool_pool = pool;
+    if (pthread_create(&drain_tid, NULL, drain_thread, NULL) != 0) {
+        perror("[SPOOL] pthread_create");
+        return -1;
+    }
+    started = 1;
+    if (file_has_data(spool_path) || file_has_data(drain_path))
+        printf("[SPOOL] Found spooled writes in %s, will drain when MongoDB is healthy\n", spool_path);
+    return 0;
+}
+
+void spool_shutdown(void) {
+    if (!started) return;
+    stopping = 1;
+    pthread_join(drain_tid, NULL);
+    pthread_mutex_lock(&spool_lock);
+    if (spool_out) { fclose(spool_out); spool_out = NULL; }
+    pthread_mutex_unlock(&spool_lock);
+}
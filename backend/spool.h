@@ -0,0 +1,26 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <mongoc/mongoc.h>
+
+/* Local write-ahead spool used while the circuit breaker is open.
+ *
+ *   CHAT_SPOOL_PATH   spool file (default "chat_spool.log")
+ *
+ * Spooled messages keep the _id and idempotency key they were committed
+ * with, so draining is idempotent: a record that already reached MongoDB,
+ * or whose key did, is skipped on its duplicate key error. The drain thread
+ * runs whenever the breaker is closed. */
+int spool_init(mongoc_client_pool_t *pool);
+void spool_shutdown(void);
+
+/* key is the message's idempotency key, or NULL. */
+int spool_write(const bson_oid_t *oid, int64_t ts_ms, const char *room, const char *author, const char *key, const char *text);
+
+/* True for errors worth retrying later: network, timeouts, no primary.
+ * Anything else is the document's fault and fails the same way on every
+ * try, so it is not spooled; a spooled record that hits one while draining,
+ * or that cannot be parsed, is moved to CHAT_SPOOL_PATH.rejected. */
+int spool_error_transient(const bson_error_t *error);
+
+#endif
@@ -0,0 +1,347 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "chat.h"
+#include "cache.h"
+#include "intern.h"
+#include "mem.h"
+#include "net.h"
+#include "subscriber.h"
+
+#define SUB_QUEUE_MAX 1024
+#define SUB_BATCH_MAX 256
+
+/* Lines are sent in batches, one sendmsg per batch. CHAT_SEND_BATCH caps a
+ * batch; CHAT_SEND_LINGER_US lets a short batch wait that long for more
+ * lines before it goes (0, the default, sends whatever is queued at once). */
+static int send_batch = 64;
+static long send_linger_us = 0;
+
+/* SSE streams get a comment line after CHAT_SSE_HEARTBEAT_SEC idle seconds
+ * (default 15) so proxies keep them open, and advise clients to reconnect
+ * after CHAT_SSE_RETRY_MS (default 3000). */
+static int sse_heartbeat_sec = 15;
+static int sse_retry_ms = 3000;
+
+#define SUB_REPLAY_CHUNK 64
+
+/* One rendered line shared by every subscriber queue it sits in. */
+typedef struct sub_line {
+    atomic_int refs;
+    unsigned char id[CHAT_ID_LEN];
+    size_t len;
+    char text[];
+} sub_line_t;
+
+typedef struct subscriber {
+    int sock;
+    uint32_t room;           /* 0: every room */
+    int format;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sub_line_t *queue[SUB_QUEUE_MAX];
+    size_t head, tail;
+    int overflowed;
+    struct subscriber *next;
+} subscriber_t;
+
+static subscriber_t *subscribers = NULL;
+static atomic_int subscriber_count;
+static atomic_int format_count[SUB_FORMATS];
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void line_release(sub_line_t *l) {
+    if (atomic_fetch_sub(&l->refs, 1) == 1) {
+        mem_charge(MEM_SUBSCRIBER, -(long)(sizeof(*l) + l->len));
+        free(l);
+    }
+}
+
+/* Cut a subscriber off: drop its queue now and let its thread close it. */
+static size_t cut_off(subscriber_t *s) {
+    size_t freed = 0;
+    pthread_mutex_lock(&s->lock);
+    while (s->head != s->tail) {
+        sub_line_t *l = s->queue[s->head % SUB_QUEUE_MAX];
+        freed += atomic_load(&l->refs) == 1 ? sizeof(*l) + l->len : 0;
+        line_release(l);
+        s->head++;
+    }
+    s->overflowed = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return freed;
+}
+
+/* Budget reclaimer: shed the subscribers furthest behind first. */
+static size_t subscriber_reclaim(size_t want) {
+    size_t freed = 0;
+    pthread_mutex_lock(&list_lock);
+    while (freed < want) {
+        subscriber_t *worst = NULL;
+        size_t depth = 0;
+        for (subscriber_t *s = subscribers; s; s = s->next) {
+            pthread_mutex_lock(&s->lock);
+            size_t d = s->overflowed ? 0 : s->tail - s->head;
+            pthread_mutex_unlock(&s->lock);
+            if (d > depth) { depth = d; worst = s; }
+        }
+        if (!worst) break;
+        freed += cut_off(worst);
+    }
+    pthread_mutex_unlock(&list_lock);
+    return freed;
+}
+
+/* "id: <hex>\ndata: <json>\n\n"; out must hold sse_max(msg) bytes. */
+static size_t sse_max(const chat_msg_t *msg) {
+    return chat_json_max(msg) + 16 + 2 * CHAT_ID_LEN;
+}
+
+static size_t sse_render(char *out, const chat_msg_t *msg) {
+    char *p = out;
+    memcpy(p, "id: ", 4);
+    p += 4;
+    for (int i = 0; i < CHAT_ID_LEN; i++) p += sprintf(p, "%02x", msg->id[i]);
+    memcpy(p, "\ndata: ", 7);
+    p += 7;
+    p += chat_format_json(p, msg);
+    *p++ = '\n';
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+/* "[<time>] <author>: <text>\n" and its terminator fit in this. */
+static size_t text_max(const chat_msg_t *msg) {
+    return 80 + intern_len(msg->author) + msg->len;
+}
+
+static sub_line_t *line_render(const chat_msg_t *msg, int format) {
+    size_t len, cap = format == SUB_SSE ? sse_max(msg) : text_max(msg);
+    if (mem_try_charge(MEM_SUBSCRIBER, sizeof(sub_line_t) + cap) != 0) return NULL;
+    sub_line_t *line = malloc(sizeof(*line) + cap);
+    if (!line) { mem_charge(MEM_SUBSCRIBER, -(long)(sizeof(*line) + cap)); return NULL; }
+    if (format == SUB_SSE) len = sse_render(line->text, msg);
+    else len = chat_format_line(line->text, cap, msg->ts_ms, msg->author, msg->text, msg->len);
+    /* Charge what the line keeps, not the worst case. */
+    mem_charge(MEM_SUBSCRIBER, -(long)(cap - len));
+    line->len = len;
+    memcpy(line->id, msg->id, CHAT_ID_LEN);
+    atomic_init(&line->refs, 1);
+    return line;
+}
+
+/* Commit listener: queue the line for every subscriber. A subscriber that
+ * falls SUB_QUEUE_MAX lines behind is cut off rather than slowing writers,
+ * and when the memory budget is exhausted the line is shed. */
+static void subscriber_on_commit(const chat_msg_t *msg, void *ctx) {
+    (void)ctx;
+    if (atomic_load(&subscriber_count) == 0) return;
+
+    /* Rendered once per format in use, shared by all its subscribers, and
+     * before list_lock: charging may run the reclaimer, which takes it. */
+    sub_line_t *lines[SUB_FORMATS] = { NULL };
+    for (int f = 0; f < SUB_FORMATS; f++)
+        if (atomic_load(&format_count[f]) > 0) lines[f] = line_render(msg, f);
+
+    pthread_mutex_lock(&list_lock);
+    for (subscriber_t *s = subscribers; s; s = s->next) {
+        if (s->room && s->room != msg->room) continue;
+        sub_line_t *line = lines[s->format];
+        if (!line) continue;
+        pthread_mutex_lock(&s->lock);
+        if (s->tail - s->head >= SUB_QUEUE_MAX) {
+            s->overflowed = 1;
+        } else {
+            atomic_fetch_add(&line->refs, 1);
+            s->queue[s->tail % SUB_QUEUE_MAX] = line;
+            s->tail++;
+        }
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&list_lock);
+    for (int f = 0; f < SUB_FORMATS; f++)
+        if (lines[f]) line_release(lines[f]);
+}
+
+/* Subscribers never send after the role line, so readable means EOF. */
+static int peer_closed(int sock) {
+    char c;
+    ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+int subscriber_init(void) {
+    const char *env = getenv("CHAT_SEND_BATCH");
+    if (env && atoi(env) > 0) send_batch = atoi(env) < SUB_BATCH_MAX ? atoi(env) : SUB_BATCH_MAX;
+    env = getenv("CHAT_SEND_LINGER_US");
+    if (env && atol(env) > 0) send_linger_us = atol(env);
+    env = getenv("CHAT_SSE_HEARTBEAT_SEC");
+    if (env && atoi(env) > 0) sse_heartbeat_sec = atoi(env);
+    env = getenv("CHAT_SSE_RETRY_MS");
+    if (env && atoi(env) > 0) sse_retry_ms = atoi(env);
+    mem_set_reclaim(MEM_SUBSCRIBER, subscriber_reclaim);
+    return commit_subscribe(subscriber_on_commit, NULL);
+}
+
+/* Replayed ids, sorted, so live lines queued during the replay that it
+ * already covered can be dropped. */
+typedef struct replay {
+    char *buf;
+    size_t len, cap;
+    unsigned char (*ids)[CHAT_ID_LEN];
+    size_t count;
+    int failed;
+} replay_t;
+
+static int id_cmp(const void *a, const void *b) {
+    return memcmp(a, b, CHAT_ID_LEN);
+}
+
+static void replay_line(const chat_msg_t *msg, void *ctx) {
+    replay_t *rp = ctx;
+    size_t need = rp->len + sse_max(msg);
+    if (rp->failed) return;
+    if (need > rp->cap) {
+        size_t cap = rp->cap * 2 > need ? rp->cap * 2 : need;
+        char *grown = realloc(rp->buf, cap);
+        if (!grown) { rp->failed = 1; return; }
+        rp->buf = grown;
+        rp->cap = cap;
+    }
+    rp->len += sse_render(rp->buf + rp->len, msg);
+    /* Only the newest SUB_QUEUE_MAX can also be sitting in the queue. */
+    memcpy(rp->ids[rp->count++ % SUB_QUEUE_MAX], msg->id, CHAT_ID_LEN);
+}
+
+/* Send what the in-memory log holds after the resume id. The subscriber
+ * is already registered, so nothing committed from here on is missed. */
+static int replay(subscriber_t *s, const unsigned char resume[CHAT_ID_LEN], replay_t *rp) {
+    uint64_t upto = cache_seq();
+    uint64_t pos = cache_find(resume);
+    if (pos == UINT64_MAX) {
+        static const char gap[] = "event: gap\ndata: {\"reason\":\"resume point no longer in memory\"}\n\n";
+        return send(s->sock, gap, sizeof(gap) - 1, MSG_NOSIGNAL) < 0 ? -1 : 0;
+    }
+    rp->ids = malloc(SUB_QUEUE_MAX * sizeof(*rp->ids));
+    if (!rp->ids) return -1;
+    while (pos < upto) {
+        rp->len = 0;
+        cache_visit_from(&pos, upto, s->room, SUB_REPLAY_CHUNK, replay_line, rp);
+        if (rp->failed) return -1;
+        struct iovec iov = { rp->buf, rp->len };
+        if (rp->len && net_sendv(s->sock, &iov, 1) < 0) return -1;
+    }
+    if (rp->count > SUB_QUEUE_MAX) rp->count = SUB_QUEUE_MAX;
+    qsort(rp->ids, rp->count, CHAT_ID_LEN, id_cmp);
+    return 0;
+}
+
+void subscriber_serve(int sock, uint32_t room, int format, const unsigned char *resume) {
+    subscriber_t *s = calloc(1, sizeof(*s));
+    if (!s) { close(sock); return; }
+    s->sock = sock;
+    s->room = room;
+    s->format = format;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    pthread_mutex_lock(&list_lock);
+    s->next = subscribers;
+    subscribers = s;
+    atomic_fetch_add(&subscriber_count, 1);
+    atomic_fetch_add(&format_count[format], 1);
+    pthread_mutex_unlock(&list_lock);
+
+    printf("[SERVER] Subscriber connected (sock=%d)\n", sock);
+    int alive = 1;
+    if (format == SUB_TEXT) {
+        send(sock, "OK: subscribed\n", 15, MSG_NOSIGNAL);
+    } else {
+        char retry[32];
+        int n = snprintf(retry, sizeof(retry), "retry: %d\n\n", sse_retry_ms);
+        alive = send(sock, retry, (size_t)n, MSG_NOSIGNAL) == n;
+    }
+    replay_t rp = { 0 };
+    if (alive && resume && replay(s, resume, &rp) != 0) alive = 0;
+    size_t dedupe_left = rp.count ? SUB_QUEUE_MAX : 0;
+
+    while (alive) {
+        int idle = 0, heartbeat = 0;
+        pthread_mutex_lock(&s->lock);
+        while (s->head == s->tail && !s->overflowed) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            if (pthread_cond_timedwait(&s->cond, &s->lock, &ts) == 0) continue;
+            if (peer_closed(sock)) { alive = 0; break; }
+            if (format == SUB_SSE && ++idle >= sse_heartbeat_sec) { heartbeat = 1; break; }
+        }
+        if (heartbeat) {
+            pthread_mutex_unlock(&s->lock);
+            if (send(sock, ": ping\n\n", 8, MSG_NOSIGNAL) < 0) break;
+            continue;
+        }
+        if (!alive || s->overflowed) { pthread_mutex_unlock(&s->lock); break; }
+        if (send_linger_us && s->tail - s->head < (size_t)send_batch) {
+            /* Nagle under our control: bounded wait for a fuller batch. */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += send_linger_us * 1000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            while (s->tail - s->head < (size_t)send_batch && !s->overflowed
+                   && pthread_cond_timedwait(&s->cond, &s->lock, &ts) == 0) {}
+            if (s->overflowed) { pthread_mutex_unlock(&s->lock); break; }
+        }
+        sub_line_t *batch[SUB_BATCH_MAX];
+        struct iovec iov[SUB_BATCH_MAX];
+        int n = 0;
+        while (n < send_batch && s->head != s->tail) {
+            sub_line_t *line = s->queue[s->head % SUB_QUEUE_MAX];
+            s->head++;
+            if (dedupe_left) {
+                dedupe_left--;
+                if (bsearch(line->id, rp.ids, rp.count, CHAT_ID_LEN, id_cmp)) { line_release(line); continue; }
+            }
+            batch[n] = line;
+            iov[n].iov_base = line->text;
+            iov[n].iov_len = line->len;
+            n++;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (n && net_sendv(sock, iov, n) < 0) alive = 0;
+        for (int i = 0; i < n; i++) line_release(batch[i]);
+    }
+
+    pthread_mutex_lock(&list_lock);
+    for (subscriber_t **pp = &subscribers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) { *pp = s->next; break; }
+    }
+    atomic_fetch_sub(&subscriber_count, 1);
+    atomic_fetch_sub(&format_count[format], 1);
+    pthread_mutex_unlock(&list_lock);
+
+    while (s->head != s->tail) {
+        line_release(s->queue[s->head % SUB_QUEUE_MAX]);
+        s->head++;
+    }
+    if (s->overflowed) printf("[SERVER] Subscriber too slow, dropped (sock=%d)\n", sock);
+    printf("[SERVER] Subscriber disconnected (sock=%d)\n", sock);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    close(sock);
+    free(rp.buf);
+    free(rp.ids);
+    free(s);
+}
@@ -0,0 +1,27 @@
+#ifndef SUBSCRIBER_H
+#define SUBSCRIBER_H
+
+#include <stdint.h>
+
+/* Push channel: a "subscriber" connection receives every committed message,
+ * local or replicated from another server, as a reader-format line
+ * (SUB_TEXT) or as a server-sent event carrying the message's JSON, with
+ * the message id as the event id (SUB_SSE, "id: <hex>\ndata: {...}\n\n"). */
+#define SUB_TEXT 0
+#define SUB_SSE 1
+#define SUB_FORMATS 2
+
+int subscriber_init(void);
+
+/* Serve one subscriber connection until it closes; takes ownership of sock.
+ * A non-zero room limits it to that room's messages. A SUB_TEXT subscriber
+ * is greeted with "OK: subscribed"; for SUB_SSE the caller has already sent
+ * the response headers.
+ *
+ * With a resume id (SSE Last-Event-ID) the stream first replays what the
+ * in-memory log holds after that message, then continues live without gaps
+ * or repeats. If the id is no longer in memory it gets a "gap" event and
+ * continues live; the client can backfill over GET /messages. */
+void subscriber_serve(int sock, uint32_t room, int format, const unsigned char *resume);
+
+#endif
@@ -0,0 +1,216 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <bson/bson.h>
+#include <mongoc/mongoc.h>
+
+#include "chat.h"
+#include "cache.h"
+#include "doc.h"
+#include "intern.h"
+#include "sync.h"
+
+#define SYNC_OFF 0
+#define SYNC_CHANGESTREAM 1
+#define SYNC_POLL 2
+/* Insert times come from each server's clock and are only roughly ordered,
+ * so each poll re-reads this far behind the watermark and dedupes against
+ * the cache. */
+#define SYNC_OVERLAP_SEC 2
+#define SYNC_POLL_LIMIT 1000
+
+static mongoc_client_pool_t *sync_pool = NULL;
+static pthread_t sync_tid;
+static volatile int stopping = 0;
+static int sync_mode = SYNC_OFF;
+static int poll_ms = 200;
+static unsigned char local_process[5];
+
+/* Bytes 4..8 of an ObjectId are a per-process random value. */
+static int is_local(const bson_oid_t *oid) {
+    return memcmp(oid->bytes + 4, local_process, sizeof(local_process)) == 0;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/* Publish a document inserted by another server. Returns its insert time,
+ * 0 if it has none. */
+static int64_t apply_doc(const bson_t *doc) {
+    chat_doc_t d;
+    if (chat_doc_decode(doc, &d) != 0) return 0;
+    if (!d.id || !d.text || is_local(d.id)) return d.stored_ms;
+    if (cache_contains_recent(d.id->bytes, d.ts_ms - SYNC_OVERLAP_SEC * 1000)) return d.stored_ms;
+
+    chat_msg_t msg = { d.text, d.len, d.ts_ms, {0}, 1,
+                       d.room ? intern(d.room, d.room_len) : intern(CHAT_DEFAULT_ROOM, strlen(CHAT_DEFAULT_ROOM)),
+                       d.author ? intern(d.author, d.author_len) : 0 };
+    memcpy(msg.id, d.id->bytes, CHAT_ID_LEN);
+    commit_publish(&msg);
+    return d.stored_ms;
+}
+
+/* ---- poll by insert-time watermark ---- */
+
+/* Newest insert time in the collection, or 0. */
+static int64_t load_watermark(mongoc_collection_t *coll) {
+    int64_t wm = 0;
+    bson_t *query = BCON_NEW("stored", "{", "$exists", BCON_BOOL(true), "}");
+    bson_t *opts = BCON_NEW("sort", "{", "stored", BCON_INT32(-1), "}", "limit", BCON_INT64(1));
+    chat_doc_append_read_opts(opts);
+    mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, NULL);
+    const bson_t *doc;
+    chat_doc_t d;
+    if (mongoc_cursor_next(cursor, &doc) && chat_doc_decode(doc, &d) == 0) wm = d.stored_ms;
+    mongoc_cursor_destroy(cursor);
+    bson_destroy(query);
+    bson_destroy(opts);
+    return wm;
+}
+
+/* Polls follow the "stored" insert time rather than _id: a record drained
+ * from a spool keeps the _id (and timestamp) it was committed with, which
+ * by then is older than the watermark, but it is stored when it's drained. */
+static void poll_loop(void) {
+    mongoc_client_t *client = mongoc_client_pool_pop(sync_pool);
+    mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+    int64_t wm = load_watermark(coll);
+    int behind = 0;
+    printf("[SYNC] Polling chatdb.chat every %d ms\n", poll_ms);
+
+    while (!stopping) {
+        /* Re-read the overlap, except while catching up through a backlog:
+         * a full page could then be the same page every time. */
+        int64_t floor_ms = behind ? wm : wm - SYNC_OVERLAP_SEC * 1000;
+        bson_t *query = BCON_NEW("stored", "{", behind ? "$gte" : "$gt", BCON_DATE_TIME(floor_ms), "}");
+        bson_t *opts = BCON_NEW("sort", "{", "stored", BCON_INT32(1), "}", "limit", BCON_INT64(SYNC_POLL_LIMIT));
+        chat_doc_append_read_opts(opts);
+        mongoc_cursor_t *cursor = mongoc_collection_find_with_opts(coll, query, opts, NULL);
+        const bson_t *doc;
+        int seen = 0;
+        while (mongoc_cursor_next(cursor, &doc)) {
+            int64_t stored = apply_doc(doc);
+            if (stored > wm) wm = stored;
+            seen++;
+        }
+        behind = seen == SYNC_POLL_LIMIT;
+        bson_error_t error;
+        if (mongoc_cursor_error(cursor, &error)) fprintf(stderr, "[SYNC] poll failed: %s\n", error.message);
+        mongoc_cursor_destroy(cursor);
+        bson_destroy(query);
+        bson_destroy(opts);
+        if (!behind) sleep_ms(poll_ms);
+    }
+
+    mongoc_collection_destroy(coll);
+    mongoc_client_pool_push(sync_pool, client);
+}
+
+/* ---- change streams ---- */
+
+/* Returns 0 on shutdown, -1 if change streams are unavailable here. */
+static int changestream_loop(void) {
+    mongoc_client_t *client = mongoc_client_pool_pop(sync_pool);
+    mongoc_collection_t *coll = mongoc_client_get_collection(client, "chatdb", "chat");
+    bson_t *pipeline = BCON_NEW("pipeline", "[", "{", "$match", "{", "operationType", BCON_UTF8("insert"), "}", "}", "]");
+    bson_t *resume = NULL;
+    bson_error_t error;
+    int established = 0;
+    int rc = 0;
+
+    while (!stopping) {
+        bson_t *opts = BCON_NEW("maxAwaitTimeMS", BCON_INT64(1000));
+        if (resume) BSON_APPEND_DOCUMENT(opts, "resumeAfter", resume);
+        mongoc_change_stream_t *stream = mongoc_collection_watch(coll, pipeline, opts);
+        bson_destroy(opts);
+
+        const bson_t *event;
+        memset(&error, 0, sizeof(error));
+        while (!stopping) {
+            if (mongoc_change_stream_next(stream, &event)) {
+                bson_iter_t it;
+                if (bson_iter_init_find(&it, event, "fullDocument") && BSON_ITER_HOLDS_DOCUMENT(&it)) {
+                    uint32_t len;
+                    const uint8_t *data;
+                    bson_t full;
+                    bson_iter_document(&it, &len, &data);
+                    if (bson_init_static(&full, data, len)) apply_doc(&full);
+                }
+            } else if (mongoc_change_stream_error_document(stream, &error, NULL)) {
+                break;
+            }
+            if (!established) {
+                established = 1;
+                printf("[SYNC] Tailing chatdb.chat change stream\n");
+            }
+            const bson_t *token = mongoc_change_stream_get_resume_token(stream);
+            if (token) {
+                if (resume) bson_destroy(resume);
+                resume = bson_copy(token);
+            }
+        }
+        mongoc_change_stream_destroy(stream);
+        if (stopping) break;
+
+        if (!established) {
+            fprintf(stderr, "[SYNC] change streams unavailable (%s), falling back to polling\n", error.message);
+            rc = -1;
+            break;
+        }
+        fprintf(stderr, "[SYNC] change stream error: %s, resuming\n", error.message);
+        sleep_ms(1000);
+    }
+
+    if (resume) bson_destroy(resume);
+    bson_destroy(pipeline);
+    mongoc_collection_destroy(coll);
+    mongoc_client_pool_push(sync_pool, client);
+    return rc;
+}
+
+static void *sync_thread(void *arg) {
+    (void)arg;
+    if (sync_mode == SYNC_CHANGESTREAM && changestream_loop() == 0) return NULL;
+    poll_loop();
+    return NULL;
+}
+
+int sync_init(mongoc_client_pool_t *pool) {
+    const char *mode = getenv("CHAT_SYNC");
+    if (!mode || !*mode || strcasecmp(mode, "off") == 0) return 0;
+    if (strcasecmp(mode, "changestream") == 0) sync_mode = SYNC_CHANGESTREAM;
+    else if (strcasecmp(mode, "poll") == 0) sync_mode = SYNC_POLL;
+    else { fprintf(stderr, "[SYNC] unknown CHAT_SYNC mode: %s\n", mode); return -1; }
+
+    const char *ms = getenv("CHAT_SYNC_POLL_MS");
+    if (ms && atoi(ms) > 0) poll_ms = atoi(ms);
+
+    bson_oid_t probe;
+    bson_oid_init(&probe, NULL);
+    memcpy(local_process, probe.bytes + 4, sizeof(local_process));
+
+    sync_pool = pool;
+    if (pthread_create(&sync_tid, NULL, sync_thread, NULL) != 0) {
+        perror("[SYNC] pthread_create");
+        sync_mode = SYNC_OFF;
+        return -1;
+    }
+    return 0;
+}
+
+int sync_enabled(void) {
+    return sync_mode != SYNC_OFF;
+}
+
+void sync_shutdown(void) {
+    if (sync_mode == SYNC_OFF) return;
+    stopping = 1;
+    pthread_join(sync_tid, NULL);
+}
@@ -0,0 +1,23 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <mongoc/mongoc.h>
+
+/* Cross-server cache coherence for several servers sharing chatdb.chat.
+ *
+ *   CHAT_SYNC          off (default), changestream, or poll
+ *   CHAT_SYNC_POLL_MS  poll interval for poll mode (default 200)
+ *
+ * Inserts made by other servers are published on the commit stream with
+ * remote set, which feeds this node's cache and subscribers. Change streams
+ * need a replica set; on a standalone mongod the thread falls back to
+ * polling by the "stored" insert time every server writes, so messages
+ * drained late from a spool are picked up too. */
+int sync_init(mongoc_client_pool_t *pool);
+void sync_shutdown(void);
+
+/* True if other servers' inserts reach this node's cache. Without it the
+ * cache only knows local commits and can't stand in for the database. */
+int sync_enabled(void);
+
+#endif
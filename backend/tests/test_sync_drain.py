@@ -0,0 +1,167 @@
+"""Messages spooled during a storage brownout must reach peers in poll mode.
+
+Two servers share a standalone mongod with CHAT_SYNC=poll. Server A reaches
+it through a proxy the test can cut; server B connects directly. While A is
+cut off, a message written to A is spooled. B keeps writing, so its poll
+watermark moves well past the spooled message's _id. Once A is reconnected
+and drains its spool, B's readers must see the message.
+
+    CHAT_TEST_MONGO=127.0.0.1:27017 python3 tests/test_sync_drain.py
+
+Run from backend/ after make. It writes to chatdb.chat, so point it at a
+scratch mongod. Without CHAT_TEST_MONGO the test is skipped.
+"""
+import os
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+import unittest
+import uuid
+
+SERVER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "server")
+MONGO = os.environ.get("CHAT_TEST_MONGO")
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Proxy:
+    """TCP forwarder to mongod that can drop every connection on demand."""
+
+    def __init__(self, target):
+        host, port = target.rsplit(":", 1)
+        self.target = (host, int(port))
+        self.listener = socket.create_server(("127.0.0.1", 0))
+        self.port = self.listener.getsockname()[1]
+        self.up = True
+        self.conns = []
+        self.lock = threading.Lock()
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            client, _ = self.listener.accept()
+            if not self.up:
+                client.close()
+                continue
+            upstream = socket.create_connection(self.target)
+            with self.lock:
+                self.conns += [client, upstream]
+            threading.Thread(target=self.pump, args=(client, upstream), daemon=True).start()
+            threading.Thread(target=self.pump, args=(upstream, client), daemon=True).start()
+
+    def pump(self, src, dst):
+        try:
+            while data := src.recv(65536):
+                dst.sendall(data)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def cut(self):
+        self.up = False
+        with self.lock:
+            conns, self.conns = self.conns, []
+        for s in conns:
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def restore(self):
+        self.up = True
+
+
+def recv_line(sock):
+    line = b""
+    while not line.endswith(b"\n"):
+        chunk = sock.recv(1)
+        if not chunk:
+            break
+        line += chunk
+    return line.decode()
+
+
+def write(port, text):
+    """Post one message through a pipelined writer session; the reply."""
+    with socket.create_connection(("127.0.0.1", port), timeout=10) as s:
+        s.sendall(b"writer\npipeline\n")
+        assert recv_line(s) == "OK: pipelined\n"
+        s.sendall(b"start\n" + text.encode() + b"\nstop\n")
+        recv_line(s)
+        reply = recv_line(s)
+        recv_line(s)
+        return reply
+
+
+def history(port):
+    with socket.create_connection(("127.0.0.1", port), timeout=10) as s:
+        s.sendall(b"reader\n")
+        out = b""
+        while chunk := s.recv(65536):
+            out += chunk
+        return out.decode(errors="replace")
+
+
+@unittest.skipUnless(MONGO, "set CHAT_TEST_MONGO=host:port of a scratch mongod")
+class SyncDrainTest(unittest.TestCase):
+    def start(self, port, mongo, **env):
+        full = dict(os.environ, MONGO_URI=f"mongodb://{mongo}/?directConnection=true", CHAT_LISTEN=str(port),
+                    CHAT_SYNC="poll", CHAT_SYNC_POLL_MS="100", CHAT_CACHE_SIZE="100000", **env)
+        proc = subprocess.Popen([SERVER], env=full, cwd=self.dir.name,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.addCleanup(proc.wait)
+        self.addCleanup(proc.terminate)
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=1).close()
+                return
+            except OSError:
+                time.sleep(0.1)
+        self.fail(f"server on {port} did not start")
+
+    def test_drained_message_reaches_poll_peer(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.addCleanup(self.dir.cleanup)
+        proxy = Proxy(MONGO)
+        a, b = free_port(), free_port()
+        self.start(a, f"127.0.0.1:{proxy.port}", CHAT_DB_TIMEOUT_MS="300", CHAT_BREAKER_COOLDOWN_MS="1000",
+                   CHAT_SPOOL_PATH=os.path.join(self.dir.name, "spool.log"))
+        self.start(b, MONGO)
+
+        tag = uuid.uuid4().hex
+        proxy.cut()
+        reply = ""
+        for _ in range(20):
+            reply = write(a, f"spooled {tag}")
+            if "queued" in reply:
+                break
+            time.sleep(0.2)
+        self.assertIn("queued", reply)
+
+        # Move B's watermark well past the spooled message's _id.
+        for i in range(3):
+            self.assertTrue(write(b, f"direct {tag} {i}").startswith("OK"))
+            time.sleep(1.5)
+
+        proxy.restore()
+        deadline = time.time() + 15
+        while time.time() < deadline:
+            if f"spooled {tag}" in history(b):
+                return
+            time.sleep(0.5)
+        self.fail("B never saw the message A drained from its spool")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,684 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "chat.h"
+#include "mem.h"
+#include "webhook.h"
+
+#define WH_MAX_ENDPOINTS 8
+#define WH_RING_SIZE 8192
+#define WH_MAX_CONNS 8
+#define WH_MAX_PIPELINE 16
+#define WH_LINGER_MS 20
+#define WH_IO_TIMEOUT_MS 2000
+#define WH_BACKOFF_BASE_MS 100
+#define WH_BACKOFF_MAX_MS 30000
+#define WH_SPILL_AFTER 3
+
+/* One rendered event, shared by every endpoint ring it was pushed to. */
+typedef struct wh_event {
+    atomic_int refs;
+    size_t len;
+    char json[];
+} wh_event_t;
+
+typedef struct wh_conn {
+    int fd;
+    size_t rlen;
+    char rbuf[4096];
+} wh_conn_t;
+
+/* A fully formatted POST plus what acknowledging it releases. */
+typedef struct wh_req {
+    char *data;
+    size_t len;
+    size_t body_off;        /* where the JSON body starts in data */
+    int events;
+    size_t ring_events;
+    size_t spool_bytes;
+} wh_req_t;
+
+typedef struct wh_endpoint {
+    int idx;
+    char host[128];
+    char port[8];
+    char path[256];
+    char spool_path[512];
+    char rejected_path[528];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    wh_event_t *ring[WH_RING_SIZE];
+    size_t head, tail;
+    unsigned long dropped;
+
+    /* Owned by the delivery thread only. */
+    wh_conn_t conns[WH_MAX_CONNS];
+    char *spool_buf;
+    size_t spool_len, spool_pos, spool_acked;
+    int failures;
+    unsigned int seed;
+    pthread_t tid;
+} wh_endpoint_t;
+
+static wh_endpoint_t endpoints[WH_MAX_ENDPOINTS];
+static int endpoint_count = 0;
+static int cfg_batch = 64;
+static int cfg_pipeline = 4;
+static int cfg_conns = 2;
+static long cfg_spool_max = 4L * 1024 * 1024;
+static volatile int stopping = 0;
+
+static int env_int(const char *name, int def, int lo, int hi) {
+    const char *v = getenv(name);
+    if (!v || !*v) return def;
+    long n = strtol(v, NULL, 10);
+    if (n < lo) n = lo;
+    if (n > hi) n = hi;
+    return (int)n;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void deadline_in(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) { ts->tv_sec++; ts->tv_nsec -= 1000000000L; }
+}
+
+static void event_release(wh_event_t *ev) {
+    if (atomic_fetch_sub(&ev->refs, 1) == 1) {
+        mem_charge(MEM_WEBHOOK, -(long)(sizeof(*ev) + ev->len + 1));
+        free(ev);
+    }
+}
+
+/* Render the message as chat_format_json does. NULL if out of memory or
+ * over the webhook memory budget. */
+static wh_event_t *event_render(const chat_msg_t *msg) {
+    wh_event_t *ev = malloc(sizeof(*ev) + chat_json_max(msg));
+    if (!ev) return NULL;
+    ev->len = chat_format_json(ev->json, msg);
+    atomic_init(&ev->refs, 0);
+    if (mem_try_charge(MEM_WEBHOOK, sizeof(*ev) + ev->len + 1) != 0) { free(ev); return NULL; }
+    return ev;
+}
+
+/* Commit listener: runs on the writer thread, never blocks on the network. */
+static void webhook_on_commit(const chat_msg_t *msg, void *ctx) {
+    (void)ctx;
+    if (stopping || msg->remote) return;   /* the committing server delivers it */
+    wh_event_t *ev = event_render(msg);
+    if (!ev) {
+        for (int i = 0; i < endpoint_count; i++) {
+            pthread_mutex_lock(&endpoints[i].lock);
+            endpoints[i].dropped++;
+            pthread_mutex_unlock(&endpoints[i].lock);
+        }
+        return;
+    }
+    atomic_store(&ev->refs, endpoint_count + 1);
+
+    for (int i = 0; i < endpoint_count; i++) {
+        wh_endpoint_t *ep = &endpoints[i];
+        pthread_mutex_lock(&ep->lock);
+        size_t count = ep->tail - ep->head;
+        if (count >= WH_RING_SIZE) {
+            ep->dropped++;
+            pthread_mutex_unlock(&ep->lock);
+            event_release(ev);
+            continue;
+        }
+        ep->ring[ep->tail % WH_RING_SIZE] = ev;
+        ep->tail++;
+        if (count == 0 || count + 1 == (size_t)cfg_batch) pthread_cond_signal(&ep->cond);
+        pthread_mutex_unlock(&ep->lock);
+    }
+    event_release(ev);
+}
+
+static int parse_url(const char *url, wh_endpoint_t *ep) {
+    if (strncmp(url, "http://", 7) != 0) return -1;
+    const char *h = url + 7;
+    const char *slash = strchr(h, '/');
+    const char *colon = strchr(h, ':');
+    size_t hlen = slash ? (size_t)(slash - h) : strlen(h);
+    if (colon && (!slash || colon < slash)) {
+        size_t plen = (slash ? (size_t)(slash - colon) : strlen(colon)) - 1;
+        if (plen == 0 || plen >= sizeof(ep->port)) return -1;
+        memcpy(ep->port, colon + 1, plen);
+        ep->port[plen] = '\0';
+        hlen = (size_t)(colon - h);
+    } else {
+        strcpy(ep->port, "80");
+    }
+    if (hlen == 0 || hlen >= sizeof(ep->host)) return -1;
+    memcpy(ep->host, h, hlen);
+    ep->host[hlen] = '\0';
+    snprintf(ep->path, sizeof(ep->path), "%s", slash ? slash : "/");
+    return 0;
+}
+
+static int send_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void conn_close(wh_conn_t *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->rlen = 0;
+}
+
+static int conn_open(wh_endpoint_t *ep, wh_conn_t *c) {
+    if (c->fd >= 0) return 0;
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ep->host, ep->port, &hints, &res) != 0 || !res) return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) { freeaddrinfo(res); return -1; }
+    struct timeval tv = { WH_IO_TIMEOUT_MS / 1000, (WH_IO_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    c->fd = fd;
+    c->rlen = 0;
+    return 0;
+}
+
+static void conn_consume(wh_conn_t *c, size_t n) {
+    memmove(c->rbuf, c->rbuf + n, c->rlen - n);
+    c->rlen -= n;
+}
+
+/* Length of the CRLF-terminated line at the start of rbuf, reading more as
+ * needed; -1 if the line doesn't fit or the connection fails. */
+static long conn_line(wh_conn_t *c) {
+    for (;;) {
+        for (size_t i = 0; i + 1 < c->rlen; i++)
+            if (c->rbuf[i] == '\r' && c->rbuf[i + 1] == '\n') return (long)i + 2;
+        if (c->rlen >= sizeof(c->rbuf) - 1) return -1;
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - 1 - c->rlen, 0);
+        if (n <= 0) return -1;
+        c->rlen += (size_t)n;
+    }
+}
+
+/* Discard n body bytes, buffered ones first. */
+static int conn_skip(wh_conn_t *c, size_t n) {
+    if (c->rlen >= n) { conn_consume(c, n); return 0; }
+    n -= c->rlen;
+    c->rlen = 0;
+    char sink[4096];
+    while (n > 0) {
+        ssize_t got = recv(c->fd, sink, n < sizeof(sink) ? n : sizeof(sink), 0);
+        if (got <= 0) return -1;
+        n -= (size_t)got;
+    }
+    return 0;
+}
+
+/* Skip a chunked body: sized chunks up to the zero one, then trailers up to
+ * the empty line. */
+static int conn_skip_chunked(wh_conn_t *c) {
+    for (;;) {
+        long l = conn_line(c);
+        if (l < 0) return -1;
+        c->rbuf[l - 2] = '\0';
+        char *e;
+        unsigned long size = strtoul(c->rbuf, &e, 16);
+        if (e == c->rbuf) return -1;
+        conn_consume(c, (size_t)l);
+        if (size == 0) break;
+        if (conn_skip(c, size + 2) < 0) return -1;
+    }
+    for (;;) {
+        long l = conn_line(c);
+        if (l < 0) return -1;
+        conn_consume(c, (size_t)l);
+        if (l == 2) return 0;
+    }
+}
+
+/* Read one HTTP/1.1 response off a keep-alive connection. Leftover bytes of
+ * the next pipelined response stay in rbuf. Returns the status or -1. */
+static int conn_read_response(wh_conn_t *c) {
+    char *end;
+    for (;;) {
+        c->rbuf[c->rlen] = '\0';
+        end = strstr(c->rbuf, "\r\n\r\n");
+        if (end) break;
+        if (c->rlen >= sizeof(c->rbuf) - 1) return -1;
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - 1 - c->rlen, 0);
+        if (n <= 0) return -1;
+        c->rlen += (size_t)n;
+    }
+
+    int status = -1;
+    if (sscanf(c->rbuf, "HTTP/1.%*d %d", &status) != 1) return -1;
+
+    long body = -1;
+    int closing = 0, chunked = 0;
+    for (char *line = strstr(c->rbuf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        char *h = line + 2;
+        if (strncasecmp(h, "Content-Length:", 15) == 0) {
+            body = strtol(h + 15, NULL, 10);
+        } else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0) {
+            char *v = h + 18;
+            while (*v == ' ') v++;
+            if (strncasecmp(v, "chunked", 7) == 0) chunked = 1;
+        } else if (strncasecmp(h, "Connection:", 11) == 0) {
+            char *v = h + 11;
+            while (*v == ' ') v++;
+            if (strncasecmp(v, "close", 5) == 0) closing = 1;
+        }
+    }
+
+    conn_consume(c, (size_t)(end + 4 - c->rbuf));
+    if (chunked) {
+        if (conn_skip_chunked(c) < 0) return -1;
+    } else if (body >= 0) {
+        if (conn_skip(c, (size_t)body) < 0) return -1;
+    } else if (status != 204 && status != 304 && status >= 200) {
+        /* Body runs to EOF: nothing more can be read off this connection. */
+        closing = 1;
+    }
+    if (closing) conn_close(c);
+    return status;
+}
+
+/* ---- persistent retry spool: one JSON event per line ---- */
+
+static long spool_size(wh_endpoint_t *ep) {
+    struct stat st;
+    return stat(ep->spool_path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+static void spool_append(wh_endpoint_t *ep, wh_event_t **evs, size_t n) {
+    if (n == 0) return;
+    FILE *f = fopen(ep->spool_path, "a");
+    if (!f) { perror("[WEBHOOK] spool open"); ep->dropped += n; return; }
+    long size = ftell(f);
+    size_t i = 0;
+    for (; i < n; i++) {
+        if (size + (long)evs[i]->len + 1 > cfg_spool_max) break;
+        fwrite(evs[i]->json, 1, evs[i]->len, f);
+        fputc('\n', f);
+        size += (long)evs[i]->len + 1;
+    }
+    fclose(f);
+    if (i < n) {
+        ep->dropped += n - i;
+        fprintf(stderr, "[WEBHOOK] %s:%s spool full, dropped %zu events\n", ep->host, ep->port, n - i);
+    }
+}
+
+static void spool_load(wh_endpoint_t *ep) {
+    if (ep->spool_buf || spool_size(ep) == 0) return;
+    FILE *f = fopen(ep->spool_path, "r");
+    if (!f) return;
+    char *buf = malloc((size_t)cfg_spool_max + 1);
+    size_t n = buf ? fread(buf, 1, (size_t)cfg_spool_max, f) : 0;
+    fclose(f);
+    while (n > 0 && buf[n - 1] != '\n') n--;     /* ignore a torn last line */
+    if (n == 0) { free(buf); truncate(ep->spool_path, 0); return; }
+    ep->spool_buf = buf;
+    ep->spool_len = n;
+    ep->spool_pos = 0;
+    ep->spool_acked = 0;
+}
+
+/* Drop the acknowledged prefix from disk and forget the in-memory copy. */
+static void spool_settle(wh_endpoint_t *ep) {
+    if (!ep->spool_buf) return;
+    size_t acked = ep->spool_acked;
+    free(ep->spool_buf);
+    ep->spool_buf = NULL;
+    ep->spool_len = ep->spool_pos = ep->spool_acked = 0;
+    if (acked == 0) return;
+
+    long size = spool_size(ep);
+    if ((long)acked >= size) { truncate(ep->spool_path, 0); return; }
+
+    char tmp[528];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ep->spool_path);
+    FILE *in = fopen(ep->spool_path, "r");
+    FILE *out = fopen(tmp, "w");
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return;
+    }
+    fseek(in, (long)acked, SEEK_SET);
+    char chunk[8192];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) fwrite(chunk, 1, n, out);
+    fclose(in);
+    fclose(out);
+    rename(tmp, ep->spool_path);
+}
+
+/* ---- request building ---- */
+
+typedef struct strbuf { char *p; size_t len, cap; } strbuf_t;
+
+static int sb_put(strbuf_t *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + n + 1) cap *= 2;
+        char *p = realloc(b->p, cap);
+        if (!p) return -1;
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+    return 0;
+}
+
+static int req_finish(wh_endpoint_t *ep, strbuf_t *body, wh_req_t *req) {
+    sb_put(body, "]}", 2);
+    char hdr[512];
+    int h = snprintf(hdr, sizeof(hdr),
+                     "POST %s HTTP/1.1\r\nHost: %s:%s\r\nContent-Type: application/json\r\n"
+                     "Content-Length: %zu\r\nConnection: keep-alive\r\n\r\n",
+                     ep->path, ep->host, ep->port, body->len);
+    req->data = malloc((size_t)h + body->len);
+    if (!req->data) return -1;
+    memcpy(req->data, hdr, (size_t)h);
+    memcpy(req->data + h, body->p, body->len);
+    req->len = (size_t)h + body->len;
+    req->body_off = (size_t)h;
+    return 0;
+}
+
+/* Fill up to cfg_pipeline requests, spooled events first so delivery stays
+ * in commit order. Ring slots are only peeked; they are released on ack. */
+static int build_requests(wh_endpoint_t *ep, wh_req_t *reqs) {
+    int nreq = 0;
+    size_t ring_off = 0;
+    strbuf_t body = {0};
+
+    pthread_mutex_lock(&ep->lock);
+    size_t ring_count = ep->tail - ep->head;
+    pthread_mutex_unlock(&ep->lock);
+
+    while (nreq < cfg_pipeline) {
+        wh_req_t *req = &reqs[nreq];
+        memset(req, 0, sizeof(*req));
+        body.len = 0;
+        sb_put(&body, "{\"events\":[", 11);
+        int n = 0;
+
+        while (n < cfg_batch && ep->spool_buf && ep->spool_pos < ep->spool_len) {
+            char *line = ep->spool_buf + ep->spool_pos;
+            char *nl = memchr(line, '\n', ep->spool_len - ep->spool_pos);
+            size_t llen = (size_t)(nl - line);
+            if (n++) sb_put(&body, ",", 1);
+            sb_put(&body, line, llen);
+            ep->spool_pos += llen + 1;
+            req->spool_bytes += llen + 1;
+        }
+        while (n < cfg_batch && ring_off < ring_count) {
+            wh_event_t *ev = ep->ring[(ep->head + ring_off) % WH_RING_SIZE];
+            if (n++) sb_put(&body, ",", 1);
+            sb_put(&body, ev->json, ev->len);
+            ring_off++;
+            req->ring_events++;
+        }
+        if (n == 0) break;
+        req->events = n;
+        if (req_finish(ep, &body, req) < 0) break;
+        nreq++;
+    }
+    free(body.p);
+    return nreq;
+}
+
+/* The endpoint refused the batch itself: retrying would only be refused
+ * again. 408 and 429 are about timing, not content. */
+static int rejected(int status) {
+    return status >= 400 && status < 500 && status != 408 && status != 429;
+}
+
+/* Keep a refused batch, one JSON body per line, for someone to look at. */
+static void reject_request(wh_endpoint_t *ep, const wh_req_t *req, int status) {
+    FILE *f = fopen(ep->rejected_path, "a");
+    if (f) {
+        fwrite(req->data + req->body_off, 1, req->len - req->body_off, f);
+        fputc('\n', f);
+        fclose(f);
+    } else {
+        perror("[WEBHOOK] rejected open");
+        ep->dropped += (unsigned long)req->events;
+    }
+    fprintf(stderr, "[WEBHOOK] %s:%s%s refused %d events with %d, moved to %s\n",
+            ep->host, ep->port, ep->path, req->events, status, ep->rejected_path);
+}
+
+/* Send the requests spread over the connection pool, pipelined, then read
+ * responses in order. Returns how many leading requests were settled: a
+ * 2xx, or a refusal that went to the rejected file. */
+static int deliver(wh_endpoint_t *ep, wh_req_t *reqs, int nreq) {
+    int ok[WH_MAX_PIPELINE] = {0};
+    int sent[WH_MAX_PIPELINE] = {0};
+    int broken[WH_MAX_CONNS] = {0};
+
+    /* A connection that fails mid-burst stays down for the rest of it so
+     * responses can't be matched against the wrong request. */
+    for (int i = 0; i < nreq; i++) {
+        int ci = i % cfg_conns;
+        wh_conn_t *c = &ep->conns[ci];
+        if (broken[ci] || conn_open(ep, c) < 0) { broken[ci] = 1; continue; }
+        if (send_all(c->fd, reqs[i].data, reqs[i].len) < 0) { conn_close(c); broken[ci] = 1; continue; }
+        sent[i] = 1;
+    }
+    for (int i = 0; i < nreq; i++) {
+        wh_conn_t *c = &ep->conns[i % cfg_conns];
+        if (!sent[i] || c->fd < 0) continue;
+        int status = conn_read_response(c);
+        if (status < 0) { conn_close(c); continue; }
+        ok[i] = status >= 200 && status < 300 ? 1 : rejected(status) ? -status : 0;
+    }
+
+    int acked = 0;
+    for (; acked < nreq && ok[acked]; acked++)
+        if (ok[acked] < 0) reject_request(ep, &reqs[acked], -ok[acked]);
+    return acked;
+}
+
+static void ack(wh_endpoint_t *ep, wh_req_t *reqs, int acked) {
+    size_t ring_events = 0;
+    for (int i = 0; i < acked; i++) {
+        ring_events += reqs[i].ring_events;
+        ep->spool_acked += reqs[i].spool_bytes;
+    }
+    pthread_mutex_lock(&ep->lock);
+    for (size_t i = 0; i < ring_events; i++) {
+        event_release(ep->ring[ep->head % WH_RING_SIZE]);
+        ep->head++;
+    }
+    pthread_mutex_unlock(&ep->lock);
+}
+
+/* Move everything queued in memory to the spool so a long outage does not
+ * fill the ring and start dropping at the commit listener. */
+static void spill_ring(wh_endpoint_t *ep) {
+    wh_event_t *batch[256];
+    for (;;) {
+        size_t n = 0;
+        pthread_mutex_lock(&ep->lock);
+        while (n < 256 && ep->head != ep->tail) {
+            batch[n++] = ep->ring[ep->head % WH_RING_SIZE];
+            ep->head++;
+        }
+        pthread_mutex_unlock(&ep->lock);
+        if (n == 0) break;
+        spool_append(ep, batch, n);
+        for (size_t i = 0; i < n; i++) event_release(batch[i]);
+    }
+}
+
+static long backoff_ms(wh_endpoint_t *ep) {
+    int shift = ep->failures < 16 ? ep->failures : 16;
+    long delay = (long)WH_BACKOFF_BASE_MS << shift;
+    if (delay > WH_BACKOFF_MAX_MS) delay = WH_BACKOFF_MAX_MS;
+    return delay / 2 + rand_r(&ep->seed) % (delay / 2 + 1);
+}
+
+static void *delivery_thread(void *arg) {
+    wh_endpoint_t *ep = arg;
+    wh_req_t reqs[WH_MAX_PIPELINE];
+    int64_t retry_at = 0;
+
+    while (!stopping) {
+        pthread_mutex_lock(&ep->lock);
+        for (;;) {
+            if (stopping) break;
+            int64_t now = now_ms();
+            int has_work = ep->head != ep->tail || ep->spool_buf || spool_size(ep) > 0;
+            if (has_work && now >= retry_at) break;
+            struct timespec ts;
+            deadline_in(&ts, has_work ? (long)(retry_at - now) : 1000);
+            pthread_cond_timedwait(&ep->cond, &ep->lock, &ts);
+        }
+        /* Give a partial batch a moment to fill before paying for a POST. */
+        if (!stopping && ep->tail - ep->head < (size_t)cfg_batch && !ep->spool_buf) {
+            struct timespec ts;
+            deadline_in(&ts, WH_LINGER_MS);
+            pthread_cond_timedwait(&ep->cond, &ep->lock, &ts);
+        }
+        pthread_mutex_unlock(&ep->lock);
+        if (stopping) break;
+
+        spool_load(ep);
+        int nreq = build_requests(ep, reqs);
+        if (nreq == 0) continue;
+
+        int acked = deliver(ep, reqs, nreq);
+        ack(ep, reqs, acked);
+        for (int i = 0; i < nreq; i++) free(reqs[i].data);
+
+        if (acked == nreq) {
+            ep->failures = 0;
+            retry_at = 0;
+            if (ep->spool_buf && ep->spool_pos >= ep->spool_len) spool_settle(ep);
+            continue;
+        }
+
+        /* Failure: rewind the spool cursor, back off, and past a few
+         * consecutive failures push the ring to disk. */
+        spool_settle(ep);
+        ep->failures++;
+        for (int i = 0; i < cfg_conns; i++) conn_close(&ep->conns[i]);
+        if (ep->failures >= WH_SPILL_AFTER) spill_ring(ep);
+        long delay = backoff_ms(ep);
+        retry_at = now_ms() + delay;
+        fprintf(stderr, "[WEBHOOK] %s:%s%s delivery failed (%d in a row), retry in %ld ms\n",
+                ep->host, ep->port, ep->path, ep->failures, delay);
+    }
+
+    spool_settle(ep);
+    spill_ring(ep);
+    for (int i = 0; i < cfg_conns; i++) conn_close(&ep->conns[i]);
+    return NULL;
+}
+
+int webhook_init(void) {
+    const char *list = getenv("CHAT_WEBHOOKS");
+    if (!list || !*list) return 0;
+
+    cfg_batch = env_int("CHAT_WEBHOOK_BATCH", 64, 1, 4096);
+    cfg_pipeline = env_int("CHAT_WEBHOOK_PIPELINE", 4, 1, WH_MAX_PIPELINE);
+    cfg_conns = env_int("CHAT_WEBHOOK_CONNS", 2, 1, WH_MAX_CONNS);
+    cfg_spool_max = env_int("CHAT_WEBHOOK_SPOOL_MAX", 4 * 1024 * 1024, 4096, 1 << 30);
+    const char *dir = getenv("CHAT_WEBHOOK_SPOOL_DIR");
+    if (!dir || !*dir) dir = ".";
+
+    char *copy = strdup(list);
+    if (!copy) return -1;
+    char *save = NULL;
+    for (char *url = strtok_r(copy, ",", &save); url; url = strtok_r(NULL, ",", &save)) {
+        if (endpoint_count == WH_MAX_ENDPOINTS) {
+            fprintf(stderr, "[WEBHOOK] more than %d endpoints, ignoring %s\n", WH_MAX_ENDPOINTS, url);
+            continue;
+        }
+        wh_endpoint_t *ep = &endpoints[endpoint_count];
+        memset(ep, 0, sizeof(*ep));
+        if (parse_url(url, ep) < 0) {
+            fprintf(stderr, "[WEBHOOK] invalid endpoint URL: %s\n", url);
+            free(copy);
+            return -1;
+        }
+        ep->idx = endpoint_count;
+        ep->seed = (unsigned int)time(NULL) ^ (unsigned int)endpoint_count;
+        for (int i = 0; i < WH_MAX_CONNS; i++) ep->conns[i].fd = -1;
+        snprintf(ep->spool_path, sizeof(ep->spool_path), "%s/webhook-%d.spool", dir, ep->idx);
+        snprintf(ep->rejected_path, sizeof(ep->rejected_path), "%s/webhook-%d.spool.rejected", dir, ep->idx);
+        pthread_mutex_init(&ep->lock, NULL);
+        pthread_cond_init(&ep->cond, NULL);
+        endpoint_count++;
+    }
+    free(copy);
+    if (endpoint_count == 0) return 0;
+
+    for (int i = 0; i < endpoint_count; i++) {
+        if (pthread_create(&endpoints[i].tid, NULL, delivery_thread, &endpoints[i]) != 0) {
+            perror("[WEBHOOK] pthread_create");
+            endpoint_count = i;
+            webhook_shutdown();
+            return -1;
+        }
+        printf("[WEBHOOK] Delivering to http://%s:%s%s (spool %s)\n",
+               endpoints[i].host, endpoints[i].port, endpoints[i].path, endpoints[i].spool_path);
+    }
+    commit_subscribe(webhook_on_commit, NULL);
+    return 0;
+}
+
+void webhook_shutdown(void) {
+    stopping = 1;
+    for (int i = 0; i < endpoint_count; i++) {
+        pthread_mutex_lock(&endpoints[i].lock);
+        pthread_cond_broadcast(&endpoints[i].cond);
+        pthread_mutex_unlock(&endpoints[i].lock);
+    }
+    for (int i = 0; i < endpoint_count; i++) {
+        pthread_join(endpoints[i].tid, NULL);
+        if (endpoints[i].dropped)
+            fprintf(stderr, "[WEBHOOK] endpoint %d dropped %lu events\n", i, endpoints[i].dropped);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef WEBHOOK_H
+#define WEBHOOK_H
+
+/* Outbound delivery of committed messages to bot endpoints.
+ *
+ * Configured from the environment:
+ *   CHAT_WEBHOOKS            comma separated http://host:port/path list
+ *   CHAT_WEBHOOK_BATCH       events per POST (default 64)
+ *   CHAT_WEBHOOK_PIPELINE    requests in flight per connection (default 4)
+ *   CHAT_WEBHOOK_CONNS       keep-alive connections per endpoint (default 2)
+ *   CHAT_WEBHOOK_SPOOL_DIR   directory for retry spools (default ".")
+ *   CHAT_WEBHOOK_SPOOL_MAX   max spool bytes per endpoint (default 4 MiB)
+ *
+ * A batch the endpoint refuses with a 4xx other than 408 or 429 is not
+ * retried; its body goes to the spool's ".rejected" file instead.
+ *
+ * Returns 0 when disabled or started, -1 on a bad configuration. */
+int webhook_init(void);
+void webhook_shutdown(void);
+
+#endif
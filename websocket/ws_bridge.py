@@ -1,151 +1,581 @@
 
 
 import asyncio
+import base64
+import hashlib
+import hmac
+import multiprocessing
+import os
+import secrets
+import time
 import websockets
 import socket
+import struct
 import json
-from datetime import datetime
+from collections import deque
+from datetime import datetime, timezone
 
 TCP_HOST = "127.0.0.1"
 TCP_PORT = 8080
 WS_HOST = "0.0.0.0"
 WS_PORT = 8765
+# Worker processes sharing WS_PORT through SO_REUSEPORT; the kernel spreads
+# incoming connections across them.
+WORKERS = int(os.environ.get("BRIDGE_WORKERS", os.cpu_count() or 1))
+UPSTREAM_RETRY_SEC = 1
+# Longest stream line to expect: a message at the server's 4095-byte limit,
+# JSON-escaped (up to 6 bytes per byte), plus its other fields.
+UPSTREAM_LINE_MAX = 6 * 4096 + 1024
+# Writer and reader sessions travel as streams over this many shared mux
+# connections per worker, pipelined instead of one round trip per message.
+UPSTREAM_CONNS = int(os.environ.get("BRIDGE_UPSTREAM_CONNS", 2))
+# Must not exceed the server's CHAT_MUX_WINDOW.
+MUX_WINDOW = int(os.environ.get("BRIDGE_MUX_WINDOW", 65536))
 
+MUX_OPEN, MUX_DATA, MUX_CLOSE, MUX_WINDOW_GRANT = 1, 2, 3, 4
+MUX_HEADER = struct.Struct(">IBI")
+MUX_FRAME_MAX = 65536
+
+# Browsers offering the "chat.bin.v1" subprotocol get messages as binary
+# frames; everything else stays JSON text. A message record is
+#
+#   [12 bytes id][f64 ts ms][u8 len][room][u8 len][author][u32 len][message]
+#
+# (big-endian, author empty if none). Frames from the bridge: BIN_MESSAGE
+# (one record, live) and BIN_HISTORY (u8 more flag, then records). From the
+# browser: BIN_WRITE (the message text); controls stay JSON text frames.
+BINARY_PROTOCOL = "chat.bin.v1"
+JSON_PROTOCOL = "chat.json"
+BIN_MESSAGE, BIN_HISTORY, BIN_WRITE = 1, 2, 16
+# Most messages one history request returns (the server's cap).
+HISTORY_LIMIT = 1000
+
+# Every connection gets a resume token: its session id and whether it was
+# writing, signed with BRIDGE_RESUME_SECRET (shared by the workers; a fresh
+# one per bridge run if unset). A disconnected writer's session is parked
+# for BRIDGE_RESUME_GRACE_SEC (default 30) without the server's writer lock,
+# so nobody else waits on an absent browser. A browser that reconnects to
+# the same worker within the grace gets that session back (its room and
+# user settings kept) and the lock re-acquired; one that comes back later,
+# or lands on another worker, is started a new session. The messages it
+# missed are replayed after the last id it saw. Tokens expire after
+# BRIDGE_RESUME_TTL_SEC (default 300).
+RESUME_SECRET = os.environ.setdefault("BRIDGE_RESUME_SECRET", secrets.token_hex(32)).encode("ascii")
+RESUME_GRACE_SEC = int(os.environ.get("BRIDGE_RESUME_GRACE_SEC", 30))
+RESUME_TTL_SEC = int(os.environ.get("BRIDGE_RESUME_TTL_SEC", 300))
+
+# Per worker process: only this worker's clients and writer sessions.
 connected = set()
-writer_tcp_map = {}
+binary_clients = set()
+writer_sessions = {}
+# Writer sessions of disconnected browsers, by session id, until the grace ends.
+parked_sessions = {}
 
-def tcp_send_and_recv_sock(s: socket.socket, data: bytes, expect_reply=True, shutdown_write=False, timeout=5):
-    """Send bytes on existing connected socket and read reply (blocking)."""
-    try:
-        s.sendall(data)
-        if shutdown_write:
-            try:
-                s.shutdown(socket.SHUT_WR)
-            except OSError:
-                pass
-        if not expect_reply:
-            return ""
-        s.settimeout(timeout)
-        resp = b""
-        while True:
-            try:
-                chunk = s.recv(4096)
-            except socket.timeout:
+class MuxStream:
+    """One session on an upstream mux connection. Line streams resolve one
+    future per reply line, in request order (with a "TCP error: ..." line if
+    the session ends first); other streams collect everything the session
+    writes until it closes."""
+
+    def __init__(self, conn, sid, lines):
+        self.conn = conn
+        self.id = sid
+        self.lines = lines
+        self.credit = MUX_WINDOW
+        self.pending = bytearray()
+        self.inbuf = bytearray()
+        self.replies = deque()
+        self.done = asyncio.get_running_loop().create_future()
+        self.closed = False
+
+    def request(self, line: str) -> asyncio.Future:
+        """Send one command line; the future gets its reply line."""
+        fut = asyncio.get_running_loop().create_future()
+        if self.closed:
+            fut.set_result("TCP error: upstream session closed")
+            return fut
+        self.replies.append(fut)
+        self.write((line.replace("\r", " ").replace("\n", " ") + "\n").encode("utf-8"))
+        return fut
+
+    def write(self, data: bytes):
+        self.pending += data
+        self.conn.pump(self)
+
+    def close(self):
+        if not self.closed:
+            self.conn.send_frame(self.id, MUX_CLOSE)
+            self.conn.streams.pop(self.id, None)
+            self.ended("upstream session closed")
+
+    def received(self, payload: bytes):
+        self.inbuf += payload
+        self.conn.grant(self.id, len(payload))
+        if not self.lines:
+            return
+        while self.replies:
+            end = self.inbuf.find(b"\n")
+            if end < 0:
                 break
-            if not chunk:
+            line = self.inbuf[:end + 1].decode("utf-8", errors="replace")
+            del self.inbuf[:end + 1]
+            fut = self.replies.popleft()
+            if not fut.done():
+                fut.set_result(line)
+
+    def ended(self, reason: str):
+        self.closed = True
+        self.pending.clear()
+        while self.replies:
+            fut = self.replies.popleft()
+            if not fut.done():
+                fut.set_result(f"TCP error: {reason}")
+        if not self.done.done():
+            self.done.set_result(self.inbuf.decode("utf-8", errors="replace"))
+
+class UpstreamMux(asyncio.Protocol):
+    """A shared connection to the C server speaking its mux protocol
+    ("mux\\n", then [u32 stream][u8 type][u32 len] frames). Frames queued by
+    every session during one event loop iteration, credit grants included,
+    leave in a single write, so many writers' messages share each segment
+    and nobody waits for anybody else's reply."""
+
+    def __init__(self):
+        self.transport = None
+        self.ready = asyncio.get_running_loop().create_future()
+        self.streams = {}
+        self.next_id = 1
+        self.inbuf = bytearray()
+        self.out = []
+        self.grants = {}
+        self.flush_scheduled = False
+        self.alive = True
+
+    def connection_made(self, transport):
+        self.transport = transport
+        transport.write(b"mux\n")
+
+    def open(self, first: bytes, lines: bool) -> MuxStream:
+        sid = self.next_id
+        self.next_id = (self.next_id % 0xFFFFFFFF) + 1
+        stream = MuxStream(self, sid, lines)
+        self.streams[sid] = stream
+        stream.credit -= len(first)
+        self.send_frame(sid, MUX_OPEN, first)
+        return stream
+
+    def send_frame(self, sid: int, ftype: int, payload: bytes = b""):
+        if not self.alive:
+            return
+        self.out.append(MUX_HEADER.pack(sid, ftype, len(payload)))
+        if payload:
+            self.out.append(payload)
+        self.schedule_flush()
+
+    def pump(self, stream: MuxStream):
+        """Send as much of the stream's queued data as its credit allows."""
+        while stream.pending and stream.credit > 0:
+            n = min(len(stream.pending), stream.credit, MUX_FRAME_MAX)
+            self.send_frame(stream.id, MUX_DATA, bytes(stream.pending[:n]))
+            del stream.pending[:n]
+            stream.credit -= n
+
+    def grant(self, sid: int, n: int):
+        self.grants[sid] = self.grants.get(sid, 0) + n
+        self.schedule_flush()
+
+    def schedule_flush(self):
+        if not self.flush_scheduled:
+            self.flush_scheduled = True
+            asyncio.get_running_loop().call_soon(self.flush)
+
+    def flush(self):
+        self.flush_scheduled = False
+        for sid, n in self.grants.items():
+            if sid in self.streams:
+                self.out.append(MUX_HEADER.pack(sid, MUX_WINDOW_GRANT, 4) + n.to_bytes(4, "big"))
+        self.grants.clear()
+        if self.out and self.alive:
+            self.transport.write(b"".join(self.out))
+        self.out.clear()
+
+    def data_received(self, data):
+        self.inbuf += data
+        if not self.ready.done():
+            end = self.inbuf.find(b"\n")
+            if end < 0:
+                return
+            line = self.inbuf[:end].decode("utf-8", errors="replace").strip()
+            del self.inbuf[:end + 1]
+            if line != "OK: mux":
+                self.ready.set_exception(ConnectionError(line or "mux refused"))
+                self.transport.close()
+                return
+            self.ready.set_result(None)
+        pos = 0
+        while len(self.inbuf) - pos >= MUX_HEADER.size:
+            sid, ftype, n = MUX_HEADER.unpack_from(self.inbuf, pos)
+            start = pos + MUX_HEADER.size
+            if len(self.inbuf) - start < n:
                 break
-            resp += chunk
-        return resp.decode("utf-8", errors="replace")
-    except Exception as e:
-        return f"TCP error: {e}"
+            payload = bytes(self.inbuf[start:start + n])
+            pos = start + n
+            stream = self.streams.get(sid)
+            if not stream:
+                continue    # frames for a stream we already closed
+            if ftype == MUX_DATA:
+                stream.received(payload)
+            elif ftype == MUX_WINDOW_GRANT and n == 4:
+                stream.credit += int.from_bytes(payload, "big")
+                self.pump(stream)
+            elif ftype == MUX_CLOSE:
+                del self.streams[sid]
+                stream.ended("upstream session closed")
+        del self.inbuf[:pos]
+
+    def connection_lost(self, exc):
+        self.alive = False
+        if not self.ready.done():
+            self.ready.set_exception(ConnectionError("upstream closed"))
+        streams, self.streams = self.streams, {}
+        for stream in streams.values():
+            stream.ended(f"upstream connection lost: {exc or 'closed'}")
+        print(f"[WS] upstream mux connection closed ({len(streams)} sessions)")
+
+upstream_pool = []
+upstream_lock = None
+
+async def upstream_stream(first: bytes, lines: bool) -> MuxStream:
+    """Open a session on the least loaded upstream connection, connecting
+    lazily until there are UPSTREAM_CONNS of them."""
+    global upstream_lock
+    if upstream_lock is None:
+        upstream_lock = asyncio.Lock()
+    async with upstream_lock:
+        upstream_pool[:] = [c for c in upstream_pool if c.alive]
+        if len(upstream_pool) < UPSTREAM_CONNS:
+            loop = asyncio.get_running_loop()
+            _, conn = await asyncio.wait_for(loop.create_connection(UpstreamMux, TCP_HOST, TCP_PORT), 5)
+            await asyncio.wait_for(conn.ready, 5)
+            upstream_pool.append(conn)
+        conn = min(upstream_pool, key=lambda c: len(c.streams))
+    return conn.open(first, lines)
+
+class WriterSession:
+    """A browser's writer session: a pipelined writer stream upstream, with
+    the replies relayed to the browser in request order as they arrive."""
+
+    def __init__(self, ws, stream: MuxStream):
+        self.ws = ws
+        self.stream = stream
+        self.queue = asyncio.Queue()
+        self.task = asyncio.create_task(self.relay())
+        self.sid = None
+        self.expiry = None
+
+    def submit(self, kind: str, line: str):
+        self.queue.put_nowait((kind, self.stream.request(line)))
+
+    def end(self):
+        self.stream.close()
+        self.task.cancel()
+
+    def park(self, sid: str):
+        """Keep the session for its browser's return, after what it already
+        sent; replies meanwhile are lost. The writer lock is given up: the
+        server has one for everyone, and it mustn't sit with a browser that
+        may never come back."""
+        self.sid = sid
+        parked_sessions[sid] = self
+        self.submit("release", "stop")
+        self.expiry = asyncio.get_running_loop().call_later(RESUME_GRACE_SEC, self.end)
+
+    def attach(self, ws):
+        """Hand a parked session to its returning browser and take the lock
+        again; messages sent meanwhile queue up behind it."""
+        self.expiry.cancel()
+        parked_sessions.pop(self.sid, None)
+        self.ws = ws
+        self.submit("start", "start")
+
+    async def reply(self, payload: dict):
+        try:
+            await self.ws.send(json.dumps(payload))
+        except websockets.exceptions.ConnectionClosed:
+            pass
+
+    async def relay(self):
+        try:
+            while True:
+                kind, fut = await self.queue.get()
+                resp = await fut
+                ok = resp.startswith("OK")
+                if kind == "release":
+                    continue
+                if ok or kind == "stop":
+                    await self.reply({"status":"ok","role":"writer","reply":resp})
+                else:
+                    await self.reply({"status":"error","message":resp})
+                if kind == "stop" or self.stream.closed or (kind == "start" and not ok):
+                    return
+        finally:
+            wid = id(self.ws)
+            if writer_sessions.get(wid) is self:
+                writer_sessions.pop(wid)
+            if self.sid and parked_sessions.get(self.sid) is self:
+                parked_sessions.pop(self.sid)
+            self.stream.close()
+
+async def start_writer(ws):
+    """Open a writer session for ws; returns an error message or None."""
+    try:
+        stream = await upstream_stream(b"writer\npipeline\n", True)
+    except (OSError, ConnectionError, asyncio.TimeoutError) as e:
+        return f"TCP connect error: {e}"
+    # The "OK: pipelined" for the mode switch; a failed one shows
+    # up as the start's reply failing too.
+    stream.replies.append(asyncio.get_running_loop().create_future())
+    session = WriterSession(ws, stream)
+    writer_sessions[id(ws)] = session
+    # Messages sent before the lock is granted queue up behind it.
+    session.submit("start", "start")
+    return None
 
-def tcp_one_shot(role: str, control: str = None, message: str = None, timeout=5) -> str:
-    """Create a short-lived TCP connection, send role and control/message, read reply, close."""
+def b64(data: bytes) -> str:
+    return base64.urlsafe_b64encode(data).decode("ascii").rstrip("=")
+
+def issue_token(sid: str, writer: bool) -> str:
+    claims = b64(json.dumps({"sid": sid, "w": int(writer), "exp": int(time.time()) + RESUME_TTL_SEC}).encode("utf-8"))
+    return claims + "." + b64(hmac.new(RESUME_SECRET, claims.encode("ascii"), hashlib.sha256).digest())
+
+def check_token(token) -> dict:
+    """The claims of a valid, unexpired token, else None."""
+    if not isinstance(token, str) or "." not in token:
+        return None
+    claims, _, sig = token.partition(".")
+    expected = b64(hmac.new(RESUME_SECRET, claims.encode("utf-8"), hashlib.sha256).digest())
+    if not hmac.compare_digest(sig.encode("utf-8"), expected.encode("ascii")):
+        return None
     try:
-        with socket.create_connection((TCP_HOST, TCP_PORT), timeout=timeout) as s:
-            s.sendall(role.encode("utf-8"))
-            if role == "writer":
-                if control:
-                    s.sendall(control.encode("utf-8"))
-                elif message:
-                    s.sendall(message.encode("utf-8"))
-            try:
-                s.shutdown(socket.SHUT_WR)
-            except OSError:
+        data = json.loads(base64.urlsafe_b64decode(claims + "=" * (-len(claims) % 4)))
+    except ValueError:
+        return None
+    if not isinstance(data, dict) or data.get("exp", 0) < time.time() or not isinstance(data.get("sid"), str):
+        return None
+    return data
+
+def broadcast(msg: dict):
+    """Send one committed message to every client, encoded once per format."""
+    text = [c for c in connected if c not in binary_clients]
+    if text:
+        websockets.broadcast(text, json.dumps({"type": "broadcast", "payload": event_payload(msg)}))
+    if binary_clients:
+        websockets.broadcast(binary_clients, bytes([BIN_MESSAGE]) + encode_record(msg))
+
+def encode_record(msg: dict) -> bytes:
+    room = msg.get("room", "").encode("utf-8")[:255]
+    author = msg.get("author", "").encode("utf-8")[:255]
+    text = msg.get("message", "").encode("utf-8")
+    return b"".join((bytes.fromhex(msg["id"]), struct.pack(">dB", msg.get("ts", 0), len(room)), room,
+                     struct.pack(">B", len(author)), author, struct.pack(">I", len(text)), text))
+
+def event_payload(msg: dict) -> dict:
+    """JSON browser payload from one of the server's messages."""
+    ts = datetime.fromtimestamp(msg.get("ts", 0) / 1000, tz=timezone.utc)
+    payload = {"message": msg.get("message", ""), "timestamp": ts.strftime("%Y-%m-%d %H:%M:%S"),
+               "ts": msg.get("ts", 0), "id": msg.get("id"), "room": msg.get("room")}
+    if "author" in msg:
+        payload["author"] = msg["author"]
+    return payload
+
+async def upstream_feed():
+    """Follow the C server's commit stream (GET /stream, server-sent events)
+    and fan it out to this worker's clients. Every worker holds its own
+    subscription, so a message written through any worker, any other bridge
+    or a TCP client reaches everyone. Reconnects resume from the last event
+    seen, so a restart of the stream loses nothing still in server memory."""
+    last_id = None
+    while True:
+        writer = None
+        try:
+            reader, writer = await asyncio.open_connection(TCP_HOST, TCP_PORT, limit=UPSTREAM_LINE_MAX)
+            request = f"GET /stream HTTP/1.1\r\nHost: {TCP_HOST}:{TCP_PORT}\r\nAccept: text/event-stream\r\n"
+            if last_id:
+                request += f"Last-Event-ID: {last_id}\r\n"
+            writer.write((request + "\r\n").encode("ascii"))
+            await writer.drain()
+            status = await reader.readline()
+            if b" 200 " not in status:
+                raise ConnectionError(status.decode("utf-8", errors="replace").strip() or "no response")
+            while (await reader.readline()) not in (b"\r\n", b"\n", b""):
                 pass
-            resp = b""
-            while True:
-                chunk = s.recv(4096)
-                if not chunk:
-                    break
-                resp += chunk
-            return resp.decode("utf-8", errors="replace")
-    except Exception as e:
-        return f"TCP error: {e}"
-
-async def broadcast(payload: dict):
-    if not connected:
+            print(f"[WS] Worker {os.getpid()} following upstream stream")
+
+            event, event_id, data = "message", None, []
+            async for raw in reader:
+                line = raw.decode("utf-8", errors="replace").rstrip("\r\n")
+                if line:
+                    field, _, value = line.partition(":")
+                    value = value[1:] if value.startswith(" ") else value
+                    if field == "event":
+                        event = value
+                    elif field == "id":
+                        event_id = value
+                    elif field == "data":
+                        data.append(value)
+                    continue
+                if event == "message" and data:
+                    if event_id:
+                        last_id = event_id
+                    try:
+                        broadcast(json.loads("\n".join(data)))
+                    except (ValueError, TypeError, KeyError):
+                        print("[WS] skipping malformed upstream event")
+                elif event == "gap":
+                    print("[WS] upstream could not resume; some messages were missed")
+                event, event_id, data = "message", None, []
+            writer.close()
+            print("[WS] upstream stream closed")
+        except (OSError, ConnectionError, ValueError, asyncio.IncompleteReadError) as e:
+            # ValueError: a line longer than UPSTREAM_LINE_MAX
+            print(f"[WS] upstream stream unavailable: {e}")
+            if writer:
+                writer.close()
+        await asyncio.sleep(UPSTREAM_RETRY_SEC)
+
+async def fetch_history(since=None, after=None) -> list:
+    """Messages following id after, or committed at or after since (ms), oldest
+    first, or else the newest ones, from the server's in-memory log
+    (GET /messages). None if after has already left the log."""
+    path = f"/messages?limit={HISTORY_LIMIT}"
+    if after is not None:
+        path += f"&after={after}"
+    elif since is not None:
+        path += f"&since={int(since)}"
+    reader, writer = await asyncio.wait_for(asyncio.open_connection(TCP_HOST, TCP_PORT), 5)
+    try:
+        writer.write(f"GET {path} HTTP/1.1\r\nHost: {TCP_HOST}:{TCP_PORT}\r\nConnection: close\r\n\r\n".encode("ascii"))
+        status = await reader.readline()
+        if b" 410 " in status:
+            return None
+        if b" 200 " not in status:
+            raise ConnectionError(status.decode("utf-8", errors="replace").strip() or "no response")
+        length = None
+        while (line := await reader.readline()) not in (b"\r\n", b"\n", b""):
+            name, _, value = line.decode("latin-1").partition(":")
+            if name.strip().lower() == "content-length":
+                length = int(value)
+        body = await (reader.readexactly(length) if length is not None else reader.read())
+        return json.loads(body).get("messages", [])
+    finally:
+        writer.close()
+
+async def send_history(ws, since, after=None):
+    """Send the browser what it misses: after its last id if the server still
+    has it, else from its last timestamp."""
+    if after is not None and not (isinstance(after, str) and len(after) == 24 and all(c in "0123456789abcdefABCDEF" for c in after)):
+        after = None
+    if since is not None and not (isinstance(since, (int, float)) and not isinstance(since, bool) and 0 <= since < 2 ** 53):
+        since = None
+    try:
+        messages = await asyncio.wait_for(fetch_history(since, after), 5)
+        if messages is None:
+            messages = await asyncio.wait_for(fetch_history(since), 5)
+    except (OSError, ConnectionError, ValueError, asyncio.IncompleteReadError, asyncio.TimeoutError) as e:
+        await ws.send(json.dumps({"status":"error","message":f"history unavailable: {e}"}))
         return
-    data = json.dumps({"type": "broadcast", "payload": payload})
-    await asyncio.gather(*(ws.send(data) for ws in connected if ws.open))
+    more = len(messages) >= HISTORY_LIMIT
+    if ws in binary_clients:
+        await ws.send(bytes([BIN_HISTORY, more]) + b"".join(encode_record(m) for m in messages))
+    else:
+        await ws.send(json.dumps({"type": "history", "more": more, "messages": [event_payload(m) for m in messages]}))
 
 async def handle_websocket(ws, path):
     print("[WS] Client connected")
     connected.add(ws)
+    if ws.subprotocol == BINARY_PROTOCOL:
+        binary_clients.add(ws)
+    sid = secrets.token_urlsafe(16)
     try:
+        await ws.send(json.dumps({"type": "session", "token": issue_token(sid, False)}))
         async for raw in ws:
-            try:
-                data = json.loads(raw)
-            except Exception:
-                await ws.send(json.dumps({"status":"error","message":"invalid json"}))
-                continue
+            if isinstance(raw, bytes):
+                if raw[:1] != bytes([BIN_WRITE]):
+                    await ws.send(json.dumps({"status":"error","message":"unknown binary frame"}))
+                    continue
+                data = {"role": "writer", "message": raw[1:].decode("utf-8", errors="replace")}
+            else:
+                try:
+                    data = json.loads(raw)
+                except Exception:
+                    await ws.send(json.dumps({"status":"error","message":"invalid json"}))
+                    continue
 
             role = data.get("role")
             message = data.get("message", "")
             control = data.get("control", None)
 
+            if role == "history":
+                # The delta after the browser's cached history, or the latest.
+                await send_history(ws, data.get("since"), data.get("after"))
+                continue
+            if role == "resume":
+                claims = check_token(data.get("token"))
+                writing = False
+                if claims:
+                    sid = claims["sid"]
+                    session = parked_sessions.get(sid)
+                    if session and id(ws) not in writer_sessions:
+                        session.attach(ws)
+                        writer_sessions[id(ws)] = session
+                        writing = True
+                    elif claims.get("w") and id(ws) not in writer_sessions:
+                        writing = await start_writer(ws) is None
+                print(f"[WS] Client resumed ({'writer restored' if writing else 'valid token' if claims else 'token rejected'})")
+                await ws.send(json.dumps({"type": "resumed", "writer": writing, "token": issue_token(sid, writing)}))
+                await send_history(ws, data.get("since"), data.get("last_id"))
+                continue
             if role not in ("reader","writer"):
                 await ws.send(json.dumps({"status":"error","message":"role must be 'reader' or 'writer'"}))
                 continue
             if role == "reader":
-                loop = asyncio.get_running_loop()
-                resp = await loop.run_in_executor(None, tcp_one_shot, "reader", None, None)
+                try:
+                    stream = await upstream_stream(b"reader\n", False)
+                    resp = await asyncio.wait_for(stream.done, 5)
+                except (OSError, ConnectionError, asyncio.TimeoutError) as e:
+                    resp = f"TCP error: {e}"
                 await ws.send(json.dumps({"status":"ok","role":"reader","data":resp}))
                 continue
 
             wid = id(ws)
             if control == "start":
-                if wid in writer_tcp_map:
+                if wid in writer_sessions:
                     await ws.send(json.dumps({"status":"error","message":"writer session already active"}))
                     continue
-                try:
-                    s = socket.create_connection((TCP_HOST, TCP_PORT), timeout=5)
-                except Exception as e:
-                    await ws.send(json.dumps({"status":"error","message":f"TCP connect error: {e}"}))
+                error = await start_writer(ws)
+                if error:
+                    await ws.send(json.dumps({"status":"error","message":error}))
                     continue
-
-                resp = await asyncio.get_running_loop().run_in_executor(None, tcp_send_and_recv_sock, s, b"writer", True)
-
-                resp2 = await asyncio.get_running_loop().run_in_executor(None, tcp_send_and_recv_sock, s, b"start", True)
-
-                if resp2.startswith("OK"):
-                    writer_tcp_map[wid] = s
-                    await ws.send(json.dumps({"status":"ok","role":"writer","reply":resp2}))
-                else:
-                    try:
-                        s.close()
-                    except:
-                        pass
-                    await ws.send(json.dumps({"status":"error","message":resp2}))
+                await ws.send(json.dumps({"type": "session", "token": issue_token(sid, True)}))
                 continue
 
             if control == "stop":
-                s = writer_tcp_map.get(wid)
-                if not s:
+                session = writer_sessions.pop(wid, None)
+                if not session:
                     await ws.send(json.dumps({"status":"error","message":"no active writer session"}))
                     continue
-                resp = await asyncio.get_running_loop().run_in_executor(None, tcp_send_and_recv_sock, s, b"stop", True)
-                try:
-                    s.close()
-                except:
-                    pass
-                writer_tcp_map.pop(wid, None)
-                await ws.send(json.dumps({"status":"ok","role":"writer","reply":resp}))
+                session.submit("stop", "stop")
+                await ws.send(json.dumps({"type": "session", "token": issue_token(sid, False)}))
                 continue
 
             if message:
-                s = writer_tcp_map.get(wid)
-                if not s:
+                session = writer_sessions.get(wid)
+                if not session:
                     await ws.send(json.dumps({"status":"error","message":"start writer session first"}))
                     continue
-                resp = await asyncio.get_running_loop().run_in_executor(None, tcp_send_and_recv_sock, s, message.encode("utf-8"), True)
-                if resp.startswith("OK"):
-                    timestamp = datetime.utcnow().strftime("%Y-%m-%d %H:%M:%S")
-                    bobj = {"message": message, "timestamp": timestamp}
-                    await broadcast(bobj)
-                    await ws.send(json.dumps({"status":"ok","role":"writer","reply":resp}))
-                else:
-                    await ws.send(json.dumps({"status":"error","message":resp}))
+                # Replies (and the broadcast, through upstream_feed) arrive
+                # asynchronously; the browser may keep sending meanwhile.
+                session.submit("message", message)
                 continue
 
             await ws.send(json.dumps({"status":"error","message":"no control or message provided"}))
@@ -153,23 +583,58 @@ async def handle_websocket(ws, path):
     except websockets.exceptions.ConnectionClosed:
         print("[WS] Client disconnected")
     finally:
-        wid = id(ws)
-        s = writer_tcp_map.pop(wid, None)
-        if s:
-            try:
-                s.close()
-            except:
-                pass
+        session = writer_sessions.pop(id(ws), None)
+        if session and not session.stream.closed:
+            session.park(sid)
+        elif session:
+            session.end()
         connected.remove(ws)
+        binary_clients.discard(ws)
 
-async def main():
-    print(f"[WS] Serving on ws://{WS_HOST}:{WS_PORT}")
-    async with websockets.serve(handle_websocket, WS_HOST, WS_PORT):
-        await asyncio.Future()
+def listen_socket(shared: bool) -> socket.socket:
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if shared:
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    s.bind((WS_HOST, WS_PORT))
+    s.listen(1024)
+    s.setblocking(False)
+    return s
 
-if __name__ == "__main__":
+async def main(shared: bool):
+    sock = listen_socket(shared)
+    print(f"[WS] Worker {os.getpid()} serving on ws://{WS_HOST}:{WS_PORT}")
+    feed = asyncio.create_task(upstream_feed())
     try:
-        asyncio.run(main())
+        async with websockets.serve(handle_websocket, sock=sock, subprotocols=[BINARY_PROTOCOL, JSON_PROTOCOL]):
+            await asyncio.Future()
+    finally:
+        feed.cancel()
+
+def run_worker(shared: bool):
+    try:
+        asyncio.run(main(shared))
     except KeyboardInterrupt:
-        print("WS server stopped")
+        pass
+
+if __name__ == "__main__":
+    workers = WORKERS
+    if workers > 1 and not hasattr(socket, "SO_REUSEPORT"):
+        print("[WS] SO_REUSEPORT unavailable on this platform, running one worker")
+        workers = 1
+    if workers <= 1:
+        run_worker(False)
+    else:
+        procs = [multiprocessing.Process(target=run_worker, args=(True,), daemon=True) for _ in range(workers)]
+        for p in procs:
+            p.start()
+        try:
+            for p in procs:
+                p.join()
+        except KeyboardInterrupt:
+            for p in procs:
+                p.terminate()
+            for p in procs:
+                p.join()
+    print("WS server stopped")
 